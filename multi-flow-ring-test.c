@@ -0,0 +1,398 @@
+/** KUnit tests and microbenchmarks of the ring of the multi-flow device file (multi-flow-ring.h).
+ *  The helpers are driven over plain buffers and kvec iterators, without the device file:
+ *  - wrap boundaries of the split, full and empty rings, free running indices across the u32 wraparound
+ *  - copies in and out of the ring, from a work buffer (deferred commit) and from/to iterators
+ *  - a producer kthread and a consumer publishing the indices with release/acquire, as the lockless high priority flow
+ *  - get_cycles() microbenchmarks of enqueue/dequeue and of the copies of a deferred commit batch (kunit_info in the test log)
+ *  Run with: insmod multi-flow-ring-test.ko (built by make when the kernel has CONFIG_KUNIT),
+ *  or kunit.py with CONFIG_MULTI_FLOW_RING_KUNIT_TEST in a kernel tree
+ **/
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/timex.h>
+#include "multi-flow-ring.h"
+
+#define TEST_RING_SIZE 4096
+#define STRESS_BYTES (16 << 20)
+#define BENCH_MSG_SIZE 64
+#define BENCH_OPS 100000
+#define BENCH_BATCH 64                          // Writes committed by a delayed work execution (batch_size default)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#define RING_ITER_SOURCE ITER_SOURCE
+#define RING_ITER_DEST ITER_DEST
+#else
+#define RING_ITER_SOURCE WRITE
+#define RING_ITER_DEST READ
+#endif
+
+/** Byte of a stream at the free running index pos: a copy at the wrong offset gives a different byte **/
+static inline char stream_byte(u32 pos){
+  return (char)(pos * 31 + 7);
+}
+
+static void fill_stream(char *buffer, u32 pos, int len){
+  int i;
+
+  for(i=0;i<len;i++) buffer[i] = stream_byte(pos + i);
+}
+
+/** Offset of the first byte of the buffer where the stream from pos differs, -1 if none **/
+static int check_stream(const char *buffer, u32 pos, int len){
+  int i;
+
+  for(i=0;i<len;i++){
+    if(buffer[i] != stream_byte(pos + i)) return i;
+  }
+  return -1;
+}
+
+static void ring_split_test(struct kunit *test){
+  ring_span span;
+
+  // No wrap: from the start, up to the end of the buffer
+  span = ring_split(0, TEST_RING_SIZE, 100);
+  KUNIT_EXPECT_EQ(test, span.off, 0);
+  KUNIT_EXPECT_EQ(test, span.len1, 100);
+  KUNIT_EXPECT_EQ(test, span.len2, 0);
+
+  span = ring_split(TEST_RING_SIZE - 100, TEST_RING_SIZE, 100);
+  KUNIT_EXPECT_EQ(test, span.off, TEST_RING_SIZE - 100);
+  KUNIT_EXPECT_EQ(test, span.len1, 100);
+  KUNIT_EXPECT_EQ(test, span.len2, 0);
+
+  // One byte past the end
+  span = ring_split(TEST_RING_SIZE - 100, TEST_RING_SIZE, 101);
+  KUNIT_EXPECT_EQ(test, span.len1, 100);
+  KUNIT_EXPECT_EQ(test, span.len2, 1);
+
+  // The whole buffer, from any offset
+  span = ring_split(TEST_RING_SIZE + 1, TEST_RING_SIZE, TEST_RING_SIZE);
+  KUNIT_EXPECT_EQ(test, span.off, 1);
+  KUNIT_EXPECT_EQ(test, span.len1, TEST_RING_SIZE - 1);
+  KUNIT_EXPECT_EQ(test, span.len2, 1);
+
+  span = ring_split(7 * TEST_RING_SIZE, TEST_RING_SIZE, TEST_RING_SIZE);
+  KUNIT_EXPECT_EQ(test, span.off, 0);
+  KUNIT_EXPECT_EQ(test, span.len1, TEST_RING_SIZE);
+  KUNIT_EXPECT_EQ(test, span.len2, 0);
+
+  // Free running index across the u32 wraparound: the offset is still the low bits
+  span = ring_split(0xffffffffU - 9, TEST_RING_SIZE, 20);
+  KUNIT_EXPECT_EQ(test, span.off, TEST_RING_SIZE - 10);
+  KUNIT_EXPECT_EQ(test, span.len1, 10);
+  KUNIT_EXPECT_EQ(test, span.len2, 10);
+
+  // Empty copy
+  span = ring_split(123, TEST_RING_SIZE, 0);
+  KUNIT_EXPECT_EQ(test, span.len1, 0);
+  KUNIT_EXPECT_EQ(test, span.len2, 0);
+}
+
+static void ring_readable_test(struct kunit *test){
+  // Empty and full
+  KUNIT_EXPECT_EQ(test, ring_readable(0, 0, TEST_RING_SIZE), 0);
+  KUNIT_EXPECT_EQ(test, ring_readable(5 * TEST_RING_SIZE + 3, 5 * TEST_RING_SIZE + 3, TEST_RING_SIZE), 0);
+  KUNIT_EXPECT_EQ(test, ring_readable(TEST_RING_SIZE, 0, TEST_RING_SIZE), TEST_RING_SIZE);
+
+  // head wrapped around the u32, tail not yet
+  KUNIT_EXPECT_EQ(test, ring_readable(10, 0xffffffffU - 9, TEST_RING_SIZE), 20);
+  KUNIT_EXPECT_EQ(test, ring_readable(TEST_RING_SIZE - 16, (u32)-16, TEST_RING_SIZE), TEST_RING_SIZE);
+
+  // Indices corrupted by a user space mapping: never more than the size of the buffer
+  KUNIT_EXPECT_EQ(test, ring_readable(TEST_RING_SIZE + 1, 0, TEST_RING_SIZE), TEST_RING_SIZE);
+  KUNIT_EXPECT_EQ(test, ring_readable(0, 1, TEST_RING_SIZE), TEST_RING_SIZE);
+}
+
+/** Deferred commit: copies from a work buffer at every offset near the end of the ring, the bytes land in order **/
+static void ring_copy_in_test(struct kunit *test){
+  char *ring = kunit_kzalloc(test, TEST_RING_SIZE, GFP_KERNEL);
+  char *work = kunit_kzalloc(test, TEST_RING_SIZE, GFP_KERNEL);
+  u32 head;
+  int len;
+
+  KUNIT_ASSERT_NOT_NULL(test, ring);
+  KUNIT_ASSERT_NOT_NULL(test, work);
+
+  for(head = TEST_RING_SIZE - 70; head != TEST_RING_SIZE + 10; head++){
+    for(len = 0; len <= 130; len += 13){
+      memset(ring, 0, TEST_RING_SIZE);
+      fill_stream(work, head, len);
+      ring_copy_in(ring, TEST_RING_SIZE, head, work, len);
+      // First chunk at the offset of head, wrapped bytes from the start of the buffer
+      if(head % TEST_RING_SIZE + len <= TEST_RING_SIZE){
+        KUNIT_EXPECT_EQ(test, check_stream(ring + head % TEST_RING_SIZE, head, len), -1);
+      }
+      else{
+        int len1 = TEST_RING_SIZE - head % TEST_RING_SIZE;
+
+        KUNIT_EXPECT_EQ(test, check_stream(ring + head % TEST_RING_SIZE, head, len1), -1);
+        KUNIT_EXPECT_EQ(test, check_stream(ring, head + len1, len - len1), -1);
+      }
+    }
+  }
+
+  // Whole buffer: every byte written
+  fill_stream(work, 3, TEST_RING_SIZE);
+  ring_copy_in(ring, TEST_RING_SIZE, 3, work, TEST_RING_SIZE);
+  KUNIT_EXPECT_EQ(test, check_stream(ring + 3, 3, TEST_RING_SIZE - 3), -1);
+  KUNIT_EXPECT_EQ(test, check_stream(ring, TEST_RING_SIZE, 3), -1);
+}
+
+/** write/read paths: the ring filled from a kvec iterator and drained to another one, across the end of the buffer
+ *  and the u32 wraparound, until full and empty **/
+static void ring_copy_iter_test(struct kunit *test){
+  char *ring = kunit_kzalloc(test, TEST_RING_SIZE, GFP_KERNEL);
+  char *src = kunit_kzalloc(test, TEST_RING_SIZE, GFP_KERNEL);
+  char *dst = kunit_kzalloc(test, TEST_RING_SIZE, GFP_KERNEL);
+  u32 head = 0xffffffffU - 3 * TEST_RING_SIZE / 2;
+  u32 tail = head;
+  struct iov_iter iter;
+  struct kvec kvec;
+  int round;
+  int len;
+  int ret;
+
+  KUNIT_ASSERT_NOT_NULL(test, ring);
+  KUNIT_ASSERT_NOT_NULL(test, src);
+  KUNIT_ASSERT_NOT_NULL(test, dst);
+
+  for(round = 0; round < 64; round++){
+    // Fill: odd lengths until the ring is full
+    while(ring_readable(head, tail, TEST_RING_SIZE) < TEST_RING_SIZE){
+      len = min(TEST_RING_SIZE - ring_readable(head, tail, TEST_RING_SIZE), 97 + 13 * round);
+      fill_stream(src, head, len);
+      kvec.iov_base = src;
+      kvec.iov_len = len;
+      iov_iter_kvec(&iter, RING_ITER_SOURCE, &kvec, 1, len);
+      ret = ring_copy_from_iter(ring, TEST_RING_SIZE, head, &iter, len);
+      KUNIT_ASSERT_EQ(test, ret, len);
+      head += ret;
+    }
+    KUNIT_EXPECT_EQ(test, ring_readable(head, tail, TEST_RING_SIZE), TEST_RING_SIZE);
+
+    // Drain: other lengths until the ring is empty
+    while(ring_readable(head, tail, TEST_RING_SIZE) > 0){
+      len = min(ring_readable(head, tail, TEST_RING_SIZE), 61 + 29 * round);
+      memset(dst, 0, len);
+      kvec.iov_base = dst;
+      kvec.iov_len = len;
+      iov_iter_kvec(&iter, RING_ITER_DEST, &kvec, 1, len);
+      ret = ring_copy_to_iter(ring, TEST_RING_SIZE, tail, &iter, len);
+      KUNIT_ASSERT_EQ(test, ret, len);
+      KUNIT_ASSERT_EQ(test, check_stream(dst, tail, len), -1);
+      tail += ret;
+    }
+    KUNIT_EXPECT_EQ(test, ring_readable(head, tail, TEST_RING_SIZE), 0);
+    KUNIT_EXPECT_EQ(test, head, tail);
+  }
+}
+
+/** Short iterator (a fault in the user buffers): the copy stops, the wrapped chunk is not copied **/
+static void ring_copy_short_iter_test(struct kunit *test){
+  char *ring = kunit_kzalloc(test, TEST_RING_SIZE, GFP_KERNEL);
+  char *src = kunit_kzalloc(test, 64, GFP_KERNEL);
+  struct iov_iter iter;
+  struct kvec kvec;
+  int ret;
+
+  KUNIT_ASSERT_NOT_NULL(test, ring);
+  KUNIT_ASSERT_NOT_NULL(test, src);
+
+  memset(src, 0x5a, 64);
+  kvec.iov_base = src;
+  kvec.iov_len = 5;
+  iov_iter_kvec(&iter, RING_ITER_SOURCE, &kvec, 1, 5);
+  // 10 bytes before the end, 10 wrapped: only 5 available
+  ret = ring_copy_from_iter(ring, TEST_RING_SIZE, TEST_RING_SIZE - 10, &iter, 20);
+  KUNIT_EXPECT_EQ(test, ret, 5);
+  KUNIT_EXPECT_EQ(test, ring[0], 0);
+
+  // First chunk complete, wrapped chunk short
+  kvec.iov_len = 15;
+  iov_iter_kvec(&iter, RING_ITER_SOURCE, &kvec, 1, 15);
+  ret = ring_copy_from_iter(ring, TEST_RING_SIZE, TEST_RING_SIZE - 10, &iter, 20);
+  KUNIT_EXPECT_EQ(test, ret, 15);
+}
+
+// Single producer/single consumer stress: the producer kthread fills, the test thread drains
+typedef struct _stress_state{
+  char *ring;
+  u32 head;                               // Moved by the producer (release)
+  u32 tail;                               // Moved by the consumer (release)
+  char chunk[512];
+  struct completion done;
+} stress_state;
+
+static int stress_producer(void *data){
+  stress_state *state = data;
+  u32 head = 0;
+  int free;
+  int len;
+
+  while(head != STRESS_BYTES){
+    free = TEST_RING_SIZE - ring_readable(head, smp_load_acquire(&(state->tail)), TEST_RING_SIZE);
+    if(free == 0){
+      cond_resched();
+      continue;
+    }
+    len = min3(free, (int)(STRESS_BYTES - head), 1 + (int)(head % sizeof(state->chunk)));
+    fill_stream(state->chunk, head, len);
+    ring_copy_in(state->ring, TEST_RING_SIZE, head, state->chunk, len);
+    smp_store_release(&(state->head), head + len);         // Bytes visible to the consumer after the copy
+    head += len;
+  }
+  complete(&(state->done));
+  return 0;
+}
+
+static void ring_spsc_stress_test(struct kunit *test){
+  stress_state *state = kunit_kzalloc(test, sizeof(stress_state), GFP_KERNEL);
+  char *dst = kunit_kzalloc(test, TEST_RING_SIZE, GFP_KERNEL);
+  struct task_struct *producer;
+  struct iov_iter iter;
+  struct kvec kvec;
+  u32 tail = 0;
+  int readable;
+  int len;
+  int bad;
+  int ret;
+
+  KUNIT_ASSERT_NOT_NULL(test, state);
+  KUNIT_ASSERT_NOT_NULL(test, dst);
+  state->ring = kunit_kzalloc(test, TEST_RING_SIZE, GFP_KERNEL);
+  KUNIT_ASSERT_NOT_NULL(test, state->ring);
+  init_completion(&(state->done));
+
+  producer = kthread_run(stress_producer, state, "multi-flow-ring-producer");
+  KUNIT_ASSERT_FALSE(test, IS_ERR(producer));
+
+  while(tail != STRESS_BYTES){
+    readable = ring_readable(smp_load_acquire(&(state->head)), tail, TEST_RING_SIZE);
+    if(readable == 0){
+      cond_resched();
+      continue;
+    }
+    len = min(readable, 1 + (int)((tail * 7) % TEST_RING_SIZE));
+    kvec.iov_base = dst;
+    kvec.iov_len = len;
+    iov_iter_kvec(&iter, RING_ITER_DEST, &kvec, 1, len);
+    ret = ring_copy_to_iter(state->ring, TEST_RING_SIZE, tail, &iter, len);
+    bad = check_stream(dst, tail, ret);
+    if(ret != len || bad >= 0){
+      KUNIT_FAIL(test, "wrong bytes at %u (%d of %d copied)", tail + (bad >= 0 ? bad : 0), ret, len);
+      break;
+    }
+    smp_store_release(&(state->tail), tail + len);         // Space visible to the producer after the copy
+    tail += len;
+  }
+  if(tail != STRESS_BYTES){
+    // Let the producer end: the whole ring is free
+    while(!try_wait_for_completion(&(state->done))){
+      smp_store_release(&(state->tail), READ_ONCE(state->head));
+      cond_resched();
+    }
+  }
+  else wait_for_completion(&(state->done));
+}
+
+/** Enqueue/dequeue microbenchmark: messages of BENCH_MSG_SIZE bytes through the write and read paths
+ *  (kvec iterators), cycles and ns per operation **/
+static void ring_enqueue_dequeue_bench(struct kunit *test){
+  char *ring = kunit_kzalloc(test, TEST_RING_SIZE, GFP_KERNEL);
+  char *msg = kunit_kzalloc(test, BENCH_MSG_SIZE, GFP_KERNEL);
+  struct iov_iter iter;
+  struct kvec kvec;
+  cycles_t enqueue = 0;
+  cycles_t dequeue = 0;
+  cycles_t start;
+  u64 ns;
+  u32 head = TEST_RING_SIZE - BENCH_MSG_SIZE / 2;    // Every message wraps at some point
+  u32 tail = head;
+  int i;
+
+  KUNIT_ASSERT_NOT_NULL(test, ring);
+  KUNIT_ASSERT_NOT_NULL(test, msg);
+  kvec.iov_base = msg;
+  kvec.iov_len = BENCH_MSG_SIZE;
+
+  ns = ktime_get_ns();
+  for(i=0;i<BENCH_OPS;i++){
+    start = get_cycles();
+    iov_iter_kvec(&iter, RING_ITER_SOURCE, &kvec, 1, BENCH_MSG_SIZE);
+    head += ring_copy_from_iter(ring, TEST_RING_SIZE, head, &iter, BENCH_MSG_SIZE);
+    enqueue += get_cycles() - start;
+
+    start = get_cycles();
+    iov_iter_kvec(&iter, RING_ITER_DEST, &kvec, 1, BENCH_MSG_SIZE);
+    tail += ring_copy_to_iter(ring, TEST_RING_SIZE, tail, &iter, BENCH_MSG_SIZE);
+    dequeue += get_cycles() - start;
+  }
+  ns = ktime_get_ns() - ns;
+  KUNIT_EXPECT_EQ(test, head, tail);
+
+  kunit_info(test, "%d byte messages: enqueue %llu cycles, dequeue %llu cycles, %llu ns per pair\n", BENCH_MSG_SIZE,
+             (unsigned long long)enqueue / BENCH_OPS, (unsigned long long)dequeue / BENCH_OPS, ns / BENCH_OPS);
+}
+
+/** Deferred commit microbenchmark: batches of BENCH_BATCH work buffers copied in the ring with a single
+ *  publication of head, as the delayed work does under one lock acquisition. Only the ring helpers are timed:
+ *  the accounting of commit_work (reserved bytes, segment slot, head of each write) is in the device file
+ *  (flow_state) and is not part of the measure **/
+static void ring_deferred_commit_bench(struct kunit *test){
+  char *ring = kunit_kzalloc(test, TEST_RING_SIZE * 4, GFP_KERNEL);
+  char *works = kunit_kzalloc(test, BENCH_BATCH * BENCH_MSG_SIZE, GFP_KERNEL);
+  cycles_t commit = 0;
+  cycles_t start;
+  u32 published = 0;
+  u32 head = 0;
+  int batches = BENCH_OPS / BENCH_BATCH;
+  int i;
+  int j;
+
+  KUNIT_ASSERT_NOT_NULL(test, ring);
+  KUNIT_ASSERT_NOT_NULL(test, works);
+
+  for(i=0;i<batches;i++){
+    start = get_cycles();
+    for(j=0;j<BENCH_BATCH;j++){
+      ring_copy_in(ring, TEST_RING_SIZE * 4, head, works + j * BENCH_MSG_SIZE, BENCH_MSG_SIZE);
+      head += BENCH_MSG_SIZE;
+    }
+    smp_store_release(&published, head);
+    commit += get_cycles() - start;
+  }
+  KUNIT_EXPECT_EQ(test, READ_ONCE(published), (u32)(batches * BENCH_BATCH * BENCH_MSG_SIZE));
+
+  kunit_info(test, "deferred commit (copies only) of %d writes of %d bytes: %llu cycles per batch, %llu per write\n", BENCH_BATCH,
+             BENCH_MSG_SIZE, (unsigned long long)commit / batches, (unsigned long long)commit / (batches * BENCH_BATCH));
+}
+
+static struct kunit_case multi_flow_ring_cases[] = {
+  KUNIT_CASE(ring_split_test),
+  KUNIT_CASE(ring_readable_test),
+  KUNIT_CASE(ring_copy_in_test),
+  KUNIT_CASE(ring_copy_iter_test),
+  KUNIT_CASE(ring_copy_short_iter_test),
+  KUNIT_CASE(ring_spsc_stress_test),
+  KUNIT_CASE(ring_enqueue_dequeue_bench),
+  KUNIT_CASE(ring_deferred_commit_bench),
+  {}
+};
+
+static struct kunit_suite multi_flow_ring_suite = {
+  .name = "multi-flow-ring",
+  .test_cases = multi_flow_ring_cases,
+};
+kunit_test_suite(multi_flow_ring_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Stefano Costanzo");
+MODULE_DESCRIPTION("KUnit tests and microbenchmarks of the ring of the multi-flow device file");
@@ -0,0 +1,70 @@
+/** Circular buffer of a flow of the multi-flow device file.
+ *  A ring is a buffer of size bytes (power of two) with free running u32 indices: head (bytes ever written)
+ *  and tail (bytes ever read), head - tail bytes readable from ring[tail & (size - 1)].
+ *  The helpers only compute the offsets and copy the bytes, without locks, barriers or state of the device file:
+ *  the caller publishes the indices (smp_store_release) after the copy
+ **/
+
+#ifndef _MULTI_FLOW_RING_H
+#define _MULTI_FLOW_RING_H
+
+#include <linux/types.h>
+#include <linux/string.h>
+#include <linux/uio.h>
+
+// Bytes at the index of a ring: len1 from off, then len2 wrapped at the start of the buffer
+typedef struct _ring_span{
+  int off;
+  int len1;
+  int len2;
+} ring_span;
+
+/** Split len bytes at the free running index pos of a ring of size bytes (len <= size) **/
+static inline ring_span ring_split(u32 pos, int size, int len){
+  ring_span span;
+
+  span.off = pos & (size - 1);
+  span.len1 = len;
+  span.len2 = 0;
+  if((size - span.off) < len){
+    // The copy is divided in 2 steps due to circular form of the buffer
+    span.len2 = len + span.off - size;
+    span.len1 = size - span.off;
+  }
+  return span;
+}
+
+/** Bytes readable between the indices. Indices corrupted (by a user space mapping) never give more than size **/
+static inline int ring_readable(u32 head, u32 tail, int size){
+  u32 bytes = head - tail;
+
+  return bytes > size ? size : bytes;
+}
+
+/** Copy len bytes in the ring at head **/
+static inline void ring_copy_in(char *ring, int size, u32 head, const void *src, int len){
+  ring_span span = ring_split(head, size, len);
+
+  memcpy(&(ring[span.off]), src, span.len1);
+  if(span.len2 > 0) memcpy(ring, (const char *)src + span.len1, span.len2);
+}
+
+/** Copy len bytes in the ring at head from the iterator. Return the bytes copied, less than len on a fault **/
+static inline int ring_copy_from_iter(char *ring, int size, u32 head, struct iov_iter *from, int len){
+  ring_span span = ring_split(head, size, len);
+  int result = copy_from_iter(&(ring[span.off]), span.len1, from);
+
+  if(span.len2 > 0 && result == span.len1) result += copy_from_iter(ring, span.len2, from);
+  return result;
+}
+
+/** Copy len bytes out of the ring at tail to the iterator. Return the bytes copied, less than len on a fault **/
+static inline int ring_copy_to_iter(const char *ring, int size, u32 tail, struct iov_iter *to, int len){
+  ring_span span = ring_split(tail, size, len);
+  int result = copy_to_iter(&(ring[span.off]), span.len1, to);
+
+  if(span.len2 > 0 && result == span.len1) result += copy_to_iter(ring, span.len2, to);
+  return result;
+}
+
+#endif /* _MULTI_FLOW_RING_H */
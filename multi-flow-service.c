@@ -47,23 +47,60 @@
 #include<linux/uaccess.h>             
 #include <linux/kthread.h>             //kernel threads
 #include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/list.h>
+#include <linux/topology.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/log2.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/xarray.h>
+#include <linux/bitmap.h>
 #include <asm/atomic.h>
 
+#include "multi-flow-ring.h"
+
+#define CREATE_TRACE_POINTS
+#include "multi-flow-trace.h"
+
 MODULE_LICENSE("GPL"); // (AUDIT) Da togliere?
 MODULE_AUTHOR("Stefano Costanzo");
 
 #define MODNAME "MULTI-FLOW-DRIVER"
 
+struct _object_state;
 static int dev_open(struct inode *, struct file *);
 static int dev_release(struct inode *, struct file *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
+static int alloc_object(struct _object_state *the_object);
+static struct _object_state *create_object(int minor);
+static bool update_spsc(struct _object_state *the_object, fmode_t mode, int delta);
+static void spsc_off(struct _object_state *the_object);
+static void unlock_object(struct _object_state *the_object);
 
 #define DEVICE_NAME "flow-device-soa"  /* Device file name in /dev/ - not mandatory  */
 
 // Input parameters for ioctl operations
 #define IOWR_PRIORITYSTATE _IOW('a','b',int*)
 #define IOWR_BLOCKINGSTATE _IOW('a','c',int*)
+#define IOWR_PARTIALSTATE _IOW('a','d',int*)
+#define IOWR_MMAPNOTIFY _IOW('a','e',int*)
+#define IOWR_RINGSIZE _IOW('a','f',int*)
+#define IOWR_SPSCSTATE _IOW('a','g',int*)
+#define IOWR_RECORDSTATE _IOW('a','h',int*)
 #define IOWR_TIMEOUT _IOW('a','a',int*)
+#define IOWR_TIMEOUT_US _IOW('a','i',int*)
+#define IOWR_SESSIONCONFIG _IOW('a','j',session_config)
+#define IOR_FLOWSTATUS _IOR('a','k',flow_status)
 
 static int Major;            /* Major number assigned to broadcast device driver */
 
@@ -75,442 +112,1648 @@ static int Major;            /* Major number assigned to broadcast device driver
 #define get_minor(session)  MINOR(session->f_dentry->d_inode->i_rdev)
 #endif
 
-// Struct to mananage the device file
+#define MINORS 128                          // Default number of minors, and minors with a slot in the array parameters
+#define MAX_MINORS (MINORMASK + 1)
+#define OBJECT_MAX_SIZE  (4096) //default size of the buffer of each flow of the device file: just one page
+#define RING_MIN_SIZE  (PAGE_SIZE)          // The buffers are mapped in user space: at least one page
+#define RING_MAX_SIZE  (64 << 20)
+
+// Record mode: slots of the segment index of a flow, one for each RECORD_AVG_SIZE bytes of the buffer
+#define RECORD_AVG_SIZE 16
+#define RECORD_MIN_SEGMENTS 64
+
+#define LOW_PRIORITY 0
+#define HIGH_PRIORITY 1
+#define NUM_FLOWS 2
+
+// Pages of the device file mapping (mmap): control page, then the buffer of the high priority flow,
+// then the buffer of the low priority flow (sizes in the control page)
+#define MMAP_CONTROL_PAGE 0
+#define MMAP_HIGH_PAGE 1
+
+// Indices of a flow, in the control page of the device file shared with user space (mmap).
+// head and tail are free running: head - tail bytes are readable, from stream_content[tail & (size - 1)].
+// Explicit padding keeps the layout fixed for user space, with producer and consumer on different cache lines
+typedef struct _flow_control{
+  u32 head;                               // Bytes ever committed in the flow, moved by the producer
+  u32 size;                               // Size of the buffer of the flow (power of two)
+  u32 pad_producer[14];
+  u32 tail;                               // Bytes ever read from the flow, moved by the consumer
+  u32 pad_consumer[15];
+} flow_control;
+
+// Statistics of each flow of the device file (debugfs multi-flow/stats). The operations on the device file
+// (reads, trylock failures, timeouts of a read) without a flow are counted in the flow of the session priority
+enum { STAT_BYTES_WRITTEN, STAT_WRITES, STAT_BYTES_READ, STAT_READS, STAT_FULL, STAT_TIMEOUTS,
+       STAT_TRYLOCK_FAILURES, STAT_ALLOC_FAILURES, NUM_STATS };
+static const char *stat_name[NUM_STATS] = {"bytes_written", "writes", "bytes_read", "reads", "full", "timeouts",
+                                           "trylock_failures", "alloc_failures"};
+
+// Per-CPU counters of the device file (summed when read): the read/write paths never write a shared line
+typedef struct _object_stats{
+  u64 counters[NUM_FLOWS][NUM_STATS];
+} object_stats;
+
+// Latency histograms of each flow (debugfs multi-flow/histograms, with the histograms parameter set):
+// log2 buckets, bucket b counts the latencies in [2^(b-1), 2^b) ns, the last one everything above
+enum { HIST_COMMIT, HIST_RESIDENCE, HIST_WAIT, NUM_HISTS };
+static const char *hist_name[NUM_HISTS] = {"commit", "residence", "wait"};
+#define HIST_BUCKETS 32
+#define HIST_STAMPS 64
+
+typedef struct _flow_hist{
+  atomic64_t counters[NUM_HISTS][HIST_BUCKETS];    // commit: enqueue -> commit (low priority), residence: write -> read, wait: blocked in a wait queue
+  u32 stamp_head;                                  // Write times of the bytes in the flow, moved by the producer as head
+  u32 stamp_tail;                                  // moved by the consumer as tail
+  struct {
+    u32 pos;                                       // head after the write
+    u64 time;
+  } stamps[HIST_STAMPS];
+} flow_hist;
+
+// Struct to manage one flow of the device file (circular buffer)
+typedef struct _flow_state{
+  flow_control *control;                  // First byte readable (tail) and first byte writable (head)
+  int reserved_bytes;                     // Bytes reserved by pending delayed works, not yet readable
+  int size;                               // Size of the buffer (power of two), changed only with the lock held and the flow empty
+  char * stream_content;                  // The flow is a buffer in memory (pages or vmalloc)
+  flow_hist *hist;                        // Latency histograms, allocated on the first open and kept until unload
+  u32 *segments;                          // Record mode: lengths of the segments in the flow (index ring), NULL in stream mode
+  int num_segments;                       // Slots of the index (power of two)
+  u32 seg_head;                           // Segments ever written, moved by the producer with head
+  u32 seg_tail;                           // Segments ever read, moved by the consumer with tail
+  int reserved_segments;                  // Slots reserved by the pending delayed works
+} flow_state;
+
+// Struct to mananage the device file. Each device file starts on its own cache line, so the minors served
+// by different CPUs do not share lines; the fields used by every read/write come first
 typedef struct _object_state{
-  spinlock_t operation_synchronizer;      // spin_lock to syncronize operation to the file (only one thread can access the file)
-  int off_read;                           // First byte readable    
-  int off_write;                          // First byte writable
-  char * stream_content;                  // The I/O node is a buffer in memory
+  struct mutex operation_synchronizer;    // sleeping lock to syncronize operation to the file (only one thread can access the file)
+  flow_state flows[NUM_FLOWS];            // flows[HIGH_PRIORITY] and flows[LOW_PRIORITY], each one with its own buffer
+  flow_control *controls;                 // Control page of the device file: controls[LOW_PRIORITY], controls[HIGH_PRIORITY], NULL until the first open
+  object_stats __percpu *stats;           // Statistics of the flows
+  atomic_t num_readers;                   // Number readers waiting for data in the device file
+  atomic_t num_mappings;                  // Number of user space mappings of the buffers (mmap): no resize while mapped
+  struct mutex mapping_synchronizer;      // Serializes mmap and resize of the buffers
+  wait_queue_head_t read_queue;           // Queue for blocking read operations
+  wait_queue_head_t write_queue;          // Queue for blocking write operations
+  struct list_head pending_works;         // FIFO of the low priority writes waiting for the delayed work (protected by the lock)
+  int num_pending;                        // Number of writes in pending_works
+  u32 queued_works;                       // Low priority writes ever queued (protected by the lock): ticket of each write
+  u32 committed_works;                    // Low priority writes ever committed by the delayed work (protected by the lock)
+  wait_queue_head_t drain_queue;          // Queue for fsync, waiting for the commit of the writes of the session
+  struct delayed_work the_work;           // Delayed work committing the pending writes of the device file in batches, in order
+  int num_sessions;                       // Number of open sessions (protected by the lock): buffers allocated on the first one
+  int node;                               // NUMA node of the buffers, of the pending writes and of the delayed work
+  int num_producers;                      // Sessions open for writing (protected by the lock)
+  int num_consumers;                      // Sessions open for reading (protected by the lock)
+  bool spsc;                              // At most one producer and one consumer: lockless high priority flow
+  struct percpu_rw_semaphore spsc_synchronizer;   // Held (read) by the lockless operations, (write) to turn spsc off or resize
+  struct delayed_work reclaim_work;       // Release of the buffers after idle_reclaim ms without sessions
+  int minor;                              // Minor of the device file (index in objects)
+} ____cacheline_aligned_in_smp object_state;
+
+// I/O session on the device file, allocated in dev_open and kept in file->private_data
+typedef struct _session_state{
+  object_state *object;                   // Device file of the minor (kept until unload): no lookup in objects per operation
   bool priority;                          // 1 HIGH priority; 0 LOW priority
   bool blocking;                          // 1 Blocking operations;
-  int timeout;                            // Timeout for blocking operation. Default value = 200 ms(DEV)
-} object_state;
-
-//
+  bool partial;                           // 1 A write can copy only the bytes that fit in the flow
+  bool spsc;                              // 1 Lockless high priority operations (single producer/consumer, session not shared by threads)
+  s64 timeout;                            // Timeout (us) for blocking operations, hrtimer based. Default value = 200 ms(DEV)
+  u32 last_work;                          // Ticket of the last low priority write of the session (fsync barrier)
+} session_state;
+
+// Settings of the session applied with a single ioctl (IOWR_SESSIONCONFIG): all checked, then all applied
+typedef struct _session_config{
+  int priority;                           // 0 (low priority) or 1 (high priority)
+  int blocking;                           // 0 (not blocking) or 1 (blocking)
+  int partial;                            // 0 (whole write or nothing) or 1 (partial write)
+  int spsc;                               // 0 (locked operations) or 1 (lockless high priority operations)
+  int timeout;                            // Timeout (us) for blocking operations, > 0
+} session_config;
+
+// Snapshot of the device file returned by IOR_FLOWSTATUS, arrays indexed by LOW_PRIORITY and HIGH_PRIORITY
+typedef struct _flow_status{
+  int readable[NUM_FLOWS];                // Bytes readable in each flow
+  int free[NUM_FLOWS];                    // Bytes that a write can still put in each flow
+  int size[NUM_FLOWS];                    // Size of the buffer of each flow
+  int num_readers;                        // Readers waiting for data in the device file
+  int num_pending;                        // Low priority writes waiting for the delayed work
+  int pending_bytes;                      // Bytes of the writes waiting for the delayed work
+} flow_status;
+
+// Low priority write waiting to be committed in the flow by the delayed work
 typedef struct _packed_work{
-  int major;
-  int minor;   
   int copiedBytes;               // To notify the thread waiting the outcome of the operation when work is completed
-  struct work_struct the_work;
+  int size_class;                // Slab cache of the work (index in work_caches)
+  struct kiocb *iocb;            // Asynchronous request (aio/io_uring) completed after the commit, NULL for write/writev
+  u64 enqueued;                  // Enqueue time (ns) for the multi_flow_commit tracepoint and the histograms, 0 if both off
+  struct list_head list;         // Node in pending_works of the device file
   char buffer[];                // Buffer to safe the bytes to be written later in the file 
 } packed_work;
 
-#define MINORS 128
-object_state objects[MINORS];             // Struct for manage the device file
+// Device files, indexed by minor: each one is created on the first open of its minor and kept until unload,
+// so memory and init time scale with the minors in use, not with num_minors
+static DEFINE_XARRAY(objects);
+static struct kmem_cache *object_cache;
+
+static int num_minors = MINORS;                   // Minors of the device file, up to MAX_MINORS
 
-wait_queue_head_t read_queues[MINORS];           // Queues for blocking read operations
+module_param(num_minors, int, 0440);
+MODULE_PARM_DESC(num_minors, "Number of minors of the device file (default 128), state allocated on the first open of each one");
 
-#define OBJECT_MAX_SIZE  (4096) //just one page writable for the device file
+/** Device file of the minor, NULL if never opened **/
+static inline object_state *get_object(int minor){
+  return xa_load(&objects, minor);
+}
+
+// Slab caches of the pending writes, one for each size class of the buffer
+#define WORK_CLASSES 4
+static const int work_class_size[WORK_CLASSES] = {64, 256, 1024, OBJECT_MAX_SIZE};
+static const char *work_class_name[WORK_CLASSES] = {"multi-flow-work-64", "multi-flow-work-256", "multi-flow-work-1024", "multi-flow-work-4096"};
+static struct kmem_cache *work_caches[WORK_CLASSES];
 
-#define AUDIT
+// Debug log: the audit messages are printed only with the audit parameter set (static key, no cost when off).
+// Errors are always printed
+static DEFINE_STATIC_KEY_FALSE(audit_key);
+#define audit(fmt, ...) do { if(static_branch_unlikely(&audit_key)) printk(fmt, ##__VA_ARGS__); } while(0)
 #define AUDITERROR
 
+// Latency histograms: timestamps taken only with the histograms parameter set
+static DEFINE_STATIC_KEY_FALSE(hist_key);
+
+/** Boolean parameters switching a static key (kp->arg) **/
+static int set_static_key(const char *val, const struct kernel_param *kp){
+  struct static_key_false *key = kp->arg;
+  bool enable;
+  int ret = kstrtobool(val, &enable);
+
+  if(ret != 0) return ret;
+  if(enable) static_branch_enable(key);
+  else static_branch_disable(key);
+  return 0;
+}
+
+static int get_static_key(char *buffer, const struct kernel_param *kp){
+  struct static_key_false *key = kp->arg;
+
+  return scnprintf(buffer, PAGE_SIZE, "%c\n", static_key_enabled(key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops static_key_ops = {
+  .set = set_static_key,
+  .get = get_static_key,
+};
+
+module_param_cb(audit, &static_key_ops, &audit_key, 0660);
+MODULE_PARM_DESC(audit, "Debug log of the operations on the device files (default off, see also the multi_flow tracepoints)");
+module_param_cb(histograms, &static_key_ops, &hist_key, 0660);
+MODULE_PARM_DESC(histograms, "Latency histograms of the flows in debugfs multi-flow/histograms (default off)");
+
 // VFS parameters
-static bool enableDriver [MINORS];                // Enable state of files
-static unsigned int numReaders [MINORS] = {0};    // Number readers waiting in wait_queues for the device files
-static unsigned int numBytes[MINORS] = {0};       // Number bytes available in device files
+static unsigned long *enabled_minors;             // Enable state of files (bit set: enabled), num_minors bits
+static char *enable_driver_arg;                   // Values of enableDriver given at load time, applied by init_module
+static char *disabled_minors_arg;                 // Values of disabledMinors given at load time, applied by init_module
+
+/** Load time: the bitmap is allocated by init_module (num_minors can come later in the arguments), the value is kept **/
+static int keep_param_arg(char **arg, const char *val){
+  char *copy = kstrdup(val, GFP_KERNEL);
+
+  if(copy == NULL) return -ENOMEM;
+  kfree(*arg);
+  *arg = copy;
+  return 0;
+}
+
+/** enableDriver: enable state of the minors from 0, comma separated booleans ("Y,N,Y") **/
+static int apply_enable_driver(const char *val){
+  char *copy = kstrdup(val, GFP_KERNEL);
+  char *cur;
+  char *token;
+  bool enable;
+  int minor = 0;
+  int ret = 0;
+
+  if(copy == NULL) return -ENOMEM;
+  cur = strim(copy);
+  while((token = strsep(&cur, ",")) != NULL && minor < num_minors){
+    ret = kstrtobool(token, &enable);
+    if(ret != 0) break;
+    if(enable) set_bit(minor, enabled_minors);
+    else clear_bit(minor, enabled_minors);
+    minor++;
+  }
+  kfree(copy);
+  return ret;
+}
+
+/** disabledMinors: list of the disabled minors ("3,10-20"), all the others are enabled **/
+static int apply_disabled_minors(const char *val){
+  unsigned long *disabled = bitmap_zalloc(num_minors, GFP_KERNEL);
+  int ret;
+
+  if(disabled == NULL) return -ENOMEM;
+  ret = bitmap_parselist(val, disabled, num_minors);
+  if(ret == 0) bitmap_complement(enabled_minors, disabled, num_minors);
+  bitmap_free(disabled);
+  return ret;
+}
+
+static int set_enable_driver(const char *val, const struct kernel_param *kp){
+  if(enabled_minors == NULL) return keep_param_arg(&enable_driver_arg, val);
+  return apply_enable_driver(val);
+}
+
+static int get_enable_driver(char *buffer, const struct kernel_param *kp){
+  int i;
+  int len = 0;
+
+  for(i=0;i<num_minors && enabled_minors != NULL;i++){
+    len += scnprintf(buffer + len, PAGE_SIZE - len, "%s%c", i ? "," : "", test_bit(i, enabled_minors) ? 'Y' : 'N');
+  }
+  return len + scnprintf(buffer + len, PAGE_SIZE - len, "\n");
+}
+
+static int set_disabled_minors(const char *val, const struct kernel_param *kp){
+  if(enabled_minors == NULL) return keep_param_arg(&disabled_minors_arg, val);
+  return apply_disabled_minors(val);
+}
+
+static int get_disabled_minors(char *buffer, const struct kernel_param *kp){
+  unsigned long *disabled;
+  int len;
+
+  if(enabled_minors == NULL) return scnprintf(buffer, PAGE_SIZE, "\n");
+  disabled = bitmap_zalloc(num_minors, GFP_KERNEL);
+  if(disabled == NULL) return -ENOMEM;
+  bitmap_complement(disabled, enabled_minors, num_minors);
+  len = scnprintf(buffer, PAGE_SIZE, "%*pbl\n", num_minors, disabled);
+  bitmap_free(disabled);
+  return len;
+}
+
+static const struct kernel_param_ops enable_driver_ops = {
+  .set = set_enable_driver,
+  .get = get_enable_driver,
+};
+
+static const struct kernel_param_ops disabled_minors_ops = {
+  .set = set_disabled_minors,
+  .get = get_disabled_minors,
+};
+
+static int object_readable(object_state *the_object);
+static int flow_readable(flow_state *flow);
+static int flow_priority[NUM_FLOWS] = {LOW_PRIORITY, HIGH_PRIORITY};
+
+/** numReaders and numBytes are not live counters: the values are generated from the state of the device files
+ *  when the parameter is read, so the read/write paths never write a line shared by different minors.
+ *  Like ring_node they cover the first MINORS minors (the others are in debugfs multi-flow/stats) **/
+static int get_num_readers(char *buffer, const struct kernel_param *kp){
+  int i;
+  int len = 0;
+
+  for(i=0;i<min(num_minors, MINORS);i++){
+    object_state *the_object = get_object(i);
+
+    len += scnprintf(buffer + len, PAGE_SIZE - len, "%s%d", i ? "," : "", the_object ? atomic_read(&(the_object->num_readers)) : 0);
+  }
+  return len + scnprintf(buffer + len, PAGE_SIZE - len, "\n");
+}
+
+/** numBytes: both flows, numBytesHigh and numBytesLow: the flow in kp->arg **/
+static int get_num_bytes(char *buffer, const struct kernel_param *kp){
+  int i;
+  int len = 0;
+  int bytes;
+  int *priority = kp->arg;
+
+  for(i=0;i<min(num_minors, MINORS);i++){
+    object_state *the_object = get_object(i);
+
+    // The buffers of a minor without sessions can be released by the idle reclaim
+    bytes = 0;
+    if(the_object != NULL){
+      mutex_lock(&(the_object->operation_synchronizer));
+      if(the_object->controls == NULL) bytes = 0;
+      else if(priority == NULL) bytes = object_readable(the_object);
+      else bytes = flow_readable(&(the_object->flows[*priority]));
+      unlock_object(the_object);
+    }
+    len += scnprintf(buffer + len, PAGE_SIZE - len, "%s%d", i ? "," : "", bytes);
+  }
+  return len + scnprintf(buffer + len, PAGE_SIZE - len, "\n");
+}
+
+static int set_read_only(const char *val, const struct kernel_param *kp){
+  return -EPERM;
+}
 
-module_param_array(enableDriver,bool,NULL,0660);
-MODULE_PARM_DESC(enableDriver, "Enable or disable driver");
-module_param_array(numReaders, uint, NULL, 0440);                             // Only readable values
+static const struct kernel_param_ops num_readers_ops = {
+  .set = set_read_only,
+  .get = get_num_readers,
+};
+
+static const struct kernel_param_ops num_bytes_ops = {
+  .set = set_read_only,
+  .get = get_num_bytes,
+};
+
+module_param_cb(enableDriver, &enable_driver_ops, NULL, 0660);
+MODULE_PARM_DESC(enableDriver, "Enable or disable driver, for each minor from 0 (Y,N,...)");
+module_param_cb(disabledMinors, &disabled_minors_ops, NULL, 0660);
+MODULE_PARM_DESC(disabledMinors, "List of the disabled minors (e.g. 3,10-20), all the others enabled");
+module_param_cb(numReaders, &num_readers_ops, NULL, 0440);                     // Only readable values
 MODULE_PARM_DESC(numReaders, "Number of readers waiting in the flows");
-module_param_array(numBytes, uint, NULL, 0440);                               // Only readable values
+module_param_cb(numBytes, &num_bytes_ops, NULL, 0440);                         // Only readable values
 MODULE_PARM_DESC(numBytes, "Number of bytes actually present in the flows");
+module_param_cb(numBytesHigh, &num_bytes_ops, &flow_priority[HIGH_PRIORITY], 0440);
+MODULE_PARM_DESC(numBytesHigh, "Number of bytes actually present in the high priority flows");
+module_param_cb(numBytesLow, &num_bytes_ops, &flow_priority[LOW_PRIORITY], 0440);
+MODULE_PARM_DESC(numBytesLow, "Number of bytes actually present in the low priority flows");
+
+static struct dentry *debugfs_dir;                // debugfs multi-flow/: stats of the device files
+
+// Workqueue of the driver for the low priority flow
+static struct workqueue_struct *flow_workqueue;
+static int wq_max_active = 0;                     // 0: default of the kernel (WQ_DFL_ACTIVE)
+static int wq_cpu = -1;                           // -1: delayed works not bound to a CPU
+static int wq_node = NUMA_NO_NODE;                // -1: delayed works not bound to a NUMA node
+
+module_param(wq_max_active, int, 0440);
+MODULE_PARM_DESC(wq_max_active, "Max number of delayed works executed concurrently, on different minors (0 = kernel default)");
+module_param(wq_cpu, int, 0440);
+MODULE_PARM_DESC(wq_cpu, "CPU running the delayed works of the low priority flow (-1 = any CPU)");
+module_param(wq_node, int, 0440);
+MODULE_PARM_DESC(wq_node, "NUMA node running the delayed works of the low priority flow (-1 = any node)");
+
+// Buffers of the flows
+static int ring_size = OBJECT_MAX_SIZE;           // Initial size of the buffer of each flow, rounded up to a power of two
+static bool ring_high_order = false;              // Try physically contiguous (high order) pages for the buffers bigger than one page
+
+module_param(ring_size, int, 0440);
+MODULE_PARM_DESC(ring_size, "Initial size in bytes of the buffer of each flow (power of two, default one page)");
+module_param(ring_high_order, bool, 0440);
+MODULE_PARM_DESC(ring_high_order, "Back the buffers bigger than one page with high order pages instead of vmalloc, when available");
+
+// NUMA node of the buffers of each minor
+static int ring_node[MINORS] = { [0 ... MINORS - 1] = NUMA_NO_NODE };    // -1: node of the first opener
+
+module_param_array(ring_node, int, NULL, 0660);
+MODULE_PARM_DESC(ring_node, "NUMA node of the buffers and of the delayed work of each minor (-1 = node of the first opener, the minors beyond 128)");
+
+// Idle reclaim of the buffers
+static int idle_reclaim = 0;                      // ms without sessions before the empty buffers of a minor are released (0 = never)
+
+module_param(idle_reclaim, int, 0660);
+MODULE_PARM_DESC(idle_reclaim, "Time (ms) without open sessions before the empty buffers of a minor are released (0 = never)");
+
+// Batches of the low priority flow
+static int batch_size = 64;                       // Max number of writes committed with a single lock acquisition
+static int batch_delay = 0;                       // Max delay (us) of the delayed work after the first pending write
+
+module_param(batch_size, int, 0660);
+MODULE_PARM_DESC(batch_size, "Max number of low priority writes committed by the delayed work in a single batch");
+module_param(batch_delay, int, 0660);
+MODULE_PARM_DESC(batch_delay, "Max delay (us) before the delayed work commits the pending low priority writes (0 = immediately)");
 
 /* the actual driver */
 static int dev_open(struct inode *inode, struct file *file) {
 
   int minor = get_minor(file);
+  object_state *the_object;
+  session_state *session;
+  bool spsc;
 
-  if(minor >= MINORS){
+  if(minor >= num_minors){
     AUDITERROR
     printk("%s: [Major, Minor = %d, %d] Error in open. The minor number is not correct\n",MODNAME, get_major(file), minor);
     return -1;
   }
   
   // Deny access to disabled device file
-  if (!enableDriver[minor]) {
+  if (!test_bit(minor, enabled_minors)) {
     AUDITERROR
     printk("%s: [Major, Minor = %d, %d] Error open. The driver is disabled\n",MODNAME, get_major(file), minor);
     return -1;
   }
 
-  AUDIT
-  printk("%s: [Major, Minor = %d, %d] Device file successfully opened\n",MODNAME, get_major(file), minor);
+  // Session state: Default prior. true, block. true, timeout 200ms
+  session = kmalloc(sizeof(session_state), GFP_KERNEL);
+  if(session == NULL){
+    AUDITERROR
+    printk("%s: [Major, Minor = %d, %d] Error open. Session allocation failure\n",MODNAME, get_major(file), minor);
+    return -ENOMEM;
+  }
+  session->priority = true;
+  session->blocking = true;
+  session->partial = false;
+  session->spsc = false;
+  session->timeout = 200 * USEC_PER_MSEC;  // Default 200 ms
+
+  // State of the device file created on the first open of the minor
+  the_object = create_object(minor);
+  if(the_object == NULL){
+    kfree(session);
+    AUDITERROR
+    printk("%s: [Major, Minor = %d, %d] Error open. Device file allocation failure\n",MODNAME, get_major(file), minor);
+    return -ENOMEM;
+  }
+
+  // Buffers of the device file allocated on the first session (or again, after the idle reclaim)
+  if(mutex_lock_interruptible(&(the_object->operation_synchronizer))){
+    kfree(session);
+    return -ERESTARTSYS;
+  }
+  if(the_object->controls == NULL && alloc_object(the_object) != 0){
+    unlock_object(the_object);
+    kfree(session);
+    AUDITERROR
+    printk("%s: [Major, Minor = %d, %d] Error open. Buffers allocation failure\n",MODNAME, get_major(file), minor);
+    return -ENOMEM;
+  }
+  the_object->num_sessions++;
+  session->object = the_object;
+  session->last_work = the_object->committed_works;    // No write of the session to wait for
+  spsc = update_spsc(the_object, file->f_mode, 1);
+  unlock_object(the_object);
+  if(spsc) spsc_off(the_object);      // Not with the lock held: lock order of lock_flow_idle
+  file->private_data = session;
+  file->f_mode |= FMODE_NOWAIT;       // RWF_NOWAIT and io_uring inline issue: -EAGAIN instead of waiting
+
+  audit("%s: [Major, Minor = %d, %d] Device file successfully opened\n",MODNAME, get_major(file), minor);
   return 0;
 }
 
 
 static int dev_release(struct inode *inode, struct file *file) {
   int minor;
+  bool idle;
+  int reclaim = READ_ONCE(idle_reclaim);
+  session_state *session = file->private_data;
+  object_state *the_object = session->object;
   minor = get_minor(file);
 
-  AUDIT
-  printk("%s: [Major, Minor = %d, %d] Device file closed\n",MODNAME, get_major(file), minor);
+  kfree(session);
+
+  mutex_lock(&(the_object->operation_synchronizer));
+  idle = --the_object->num_sessions == 0;
+  update_spsc(the_object, file->f_mode, -1);      // Fewer sessions: the lockless mode is never turned off here
+  unlock_object(the_object);
+
+  // Last session: release the buffers if the device file stays idle
+  if(idle && reclaim > 0) mod_delayed_work(flow_workqueue, &(the_object->reclaim_work), msecs_to_jiffies(reclaim));
+
+  audit("%s: [Major, Minor = %d, %d] Device file closed\n",MODNAME, get_major(file), minor);
   //device closed by default
   return 0;
 
 }
 
 
-void delayed_work(unsigned long data){
-  /** Delayed work of work_queues **/
-  packed_work* the_work = container_of((void*)data,packed_work,the_work);
-  int i;
-  int major = the_work->major;
-  int minor = the_work->minor;
-  int len = the_work->copiedBytes;
-  int len1 = 0;
-  int len2 = 0;               // For 2nd write if off_write + len > OBJECT_MAX_SIZE (4096). Implemented for circular buffer
-  char *buff1;
-  char *buff2;
+/** Count a latency (ns) in a histogram of the flow **/
+static void hist_record(flow_hist *hist, int type, u64 latency){
+  atomic64_inc(&(hist->counters[type][min(fls64(latency), HIST_BUCKETS - 1)]));
+}
 
-  object_state *the_object = objects + minor;
+/** Start time of a wait, 0 with the histograms off **/
+static u64 hist_start(void){
+  return static_branch_unlikely(&hist_key) ? ktime_get_ns() : 0;
+}
 
+static void hist_wait(flow_state *flow, u64 start){
+  if(start && flow->hist != NULL) hist_record(flow->hist, HIST_WAIT, ktime_get_ns() - start);
+}
 
-  spin_lock(&(the_object->operation_synchronizer));
-  if((OBJECT_MAX_SIZE - the_object->off_write) >= len) {
-    buff1 = (char*) &(the_work->buffer);    // unique write
-    len1 = len;
+/** Write time of the bytes of the flow up to head, for the residence histogram. Moved by the producer with the same
+ *  rules of head (lock, or single producer); with the stamps full the bytes are not sampled **/
+static void hist_stamp(flow_state *flow, u32 head){
+  flow_hist *hist = flow->hist;
+  u32 stamp_head;
+
+  if(!static_branch_unlikely(&hist_key) || hist == NULL) return;
+  stamp_head = hist->stamp_head;
+  if(stamp_head - smp_load_acquire(&(hist->stamp_tail)) >= HIST_STAMPS) return;
+  hist->stamps[stamp_head % HIST_STAMPS].pos = head;
+  hist->stamps[stamp_head % HIST_STAMPS].time = ktime_get_ns();
+  smp_store_release(&(hist->stamp_head), stamp_head + 1);
+}
+
+/** Residence time of the writes completely read, up to tail. The stamps are consumed also with the histograms off,
+ *  so no stale time is counted when they are turned on again **/
+static void hist_unstamp(flow_state *flow, u32 tail){
+  flow_hist *hist = flow->hist;
+  u32 stamp_tail;
+  u64 now = 0;
+
+  if(hist == NULL) return;
+  stamp_tail = hist->stamp_tail;
+  while(stamp_tail != smp_load_acquire(&(hist->stamp_head)) && (s32)(tail - hist->stamps[stamp_tail % HIST_STAMPS].pos) >= 0){
+    if(static_branch_unlikely(&hist_key)){
+      if(!now) now = ktime_get_ns();
+      hist_record(hist, HIST_RESIDENCE, now - hist->stamps[stamp_tail % HIST_STAMPS].time);
+    }
+    stamp_tail++;
   }
+  smp_store_release(&(hist->stamp_tail), stamp_tail);
+}
 
-  else{
-    // The write is divided in 2 steps due to circular form of the buffer
-    len2 = len + the_object->off_write - OBJECT_MAX_SIZE;
-    len1 = OBJECT_MAX_SIZE - the_object->off_write;
+/** Drop the stamps of a flow with no operation in progress (new or resized buffer) **/
+static void hist_reset_stamps(flow_state *flow){
+  if(flow->hist == NULL) return;
+  flow->hist->stamp_head = 0;
+  flow->hist->stamp_tail = 0;
+}
+
+/** Allocate the buffer of a flow (size power of two, at least one page) on the NUMA node: physically contiguous
+ *  pages with ring_high_order or for a single page, if the allocation succeeds, vmalloc otherwise.
+ *  The buffer is zeroed, it can be mapped in user space **/
+static char *alloc_ring(int size, int node){
+  struct page *page = NULL;
+
+  if(size == PAGE_SIZE) page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+  else if(ring_high_order) page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY, get_order(size));
+  if(page != NULL) return (char*)page_address(page);
+  if(size == PAGE_SIZE) return NULL;
+
+  return (char*)vzalloc_node(size, node);
+}
 
-    buff1 = (char*) kzalloc(sizeof(char) * (len1 + 1), GFP_ATOMIC);
-    buff2 = (char*) kzalloc(sizeof(char) * (len2 + 1), GFP_ATOMIC); 
+static void free_ring(char *ring, int size){
+  if(ring == NULL) return;
+  if(is_vmalloc_addr(ring)) vfree(ring);
+  else free_pages((unsigned long)ring, get_order(size));
+}
+
+/** NUMA node of the minor: set in ring_node, otherwise the node of the caller (first opener) **/
+static int minor_node(int minor){
+  int node = minor < MINORS ? READ_ONCE(ring_node[minor]) : NUMA_NO_NODE;
+
+  if(node < 0 || node >= MAX_NUMNODES || !node_online(node)) node = numa_node_id();      // Not set or not online
+  return node;
+}
+
+static void free_object(object_state *the_object){
+  int j;
+
+  for(j=0;j<NUM_FLOWS;j++){
+    free_ring(the_object->flows[j].stream_content, the_object->flows[j].size);
+    the_object->flows[j].stream_content = NULL;
+    the_object->flows[j].control = NULL;
+    kvfree(the_object->flows[j].segments);            // Back to stream mode
+    the_object->flows[j].segments = NULL;
+  }
+  free_page((unsigned long)the_object->controls);
+  the_object->controls = NULL;
+}
 
-    // Construct strings
-    for(i = 0; i < len1; i++){
-      buff1[i] = the_work->buffer[i];
+/** Allocate the control page and the buffers (ring_size bytes) of the flows of the device file, on the node
+ *  set in ring_node or on the node of the caller (first opener). The caller holds the lock of the device file **/
+static int alloc_object(object_state *the_object){
+  flow_state *flow;
+  struct page *page;
+  int node = minor_node(the_object->minor);
+  int j;
+
+  the_object->node = node;
+
+  page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+  if(page == NULL) return -ENOMEM;
+  the_object->controls = (flow_control*)page_address(page);
+  for(j=0;j<NUM_FLOWS;j++){
+    flow = &(the_object->flows[j]);
+    flow->size = ring_size;
+    flow->stream_content = alloc_ring(ring_size, node);
+    if(flow->stream_content == NULL){
+      free_object(the_object);
+      return -ENOMEM;
     }
-    for(i = 0; i < len2; i++){
-      buff2[i] = the_work->buffer[i+len1];
+    flow->control = &(the_object->controls[j]);       // head = tail = 0
+    flow->control->size = ring_size;
+    flow->reserved_bytes = 0;
+
+    // Histograms kept across idle reclaims, not available if the allocation fails
+    if(flow->hist == NULL) flow->hist = kzalloc_node(sizeof(flow_hist), GFP_KERNEL, node);
+    hist_reset_stamps(flow);
+  }
+  return 0;
+}
+
+/** Update a counter of a flow of the device file, on the local CPU **/
+static inline void stat_add(object_state *the_object, int priority, int stat, u64 value){
+  this_cpu_add(the_object->stats->counters[priority][stat], value);
+}
+
+static inline void stat_inc(object_state *the_object, int priority, int stat){
+  this_cpu_inc(the_object->stats->counters[priority][stat]);
+}
+
+/** Indices of the flow. Both can be moved by a user space mapping, so they are read with acquire semantics **/
+static u32 flow_head(flow_state *flow){
+  return smp_load_acquire(&(flow->control->head));
+}
+
+static u32 flow_tail(flow_state *flow){
+  return smp_load_acquire(&(flow->control->tail));
+}
+
+/** Number of bytes readable in the flow (committed in the buffer and not yet read).
+ *  Indices corrupted by a user space mapping never give more than the size of the buffer **/
+static int flow_readable(flow_state *flow){
+  return ring_readable(flow_head(flow), flow_tail(flow), READ_ONCE(flow->size));
+}
+
+/** Record mode: number of free slots in the segment index of the flow **/
+static int flow_free_segments(flow_state *flow){
+  return flow->num_segments - (READ_ONCE(flow->seg_head) - smp_load_acquire(&(flow->seg_tail))) - READ_ONCE(flow->reserved_segments);
+}
+
+/** Number of bytes that can still be written in the flow: the pending delayed works have their space reserved.
+ *  In record mode nothing can be written with the segment index full **/
+static int flow_free(flow_state *flow){
+  int free = READ_ONCE(flow->size) - flow_readable(flow) - READ_ONCE(flow->reserved_bytes);
+
+  if(READ_ONCE(flow->segments) != NULL && flow_free_segments(flow) <= 0) return 0;
+
+  return free > 0 ? free : 0;
+}
+
+/** Number of bytes readable in the two flows of the device file **/
+static int object_readable(object_state *the_object){
+  return flow_readable(&(the_object->flows[HIGH_PRIORITY])) + flow_readable(&(the_object->flows[LOW_PRIORITY]));
+}
+
+/** Write in the flow from the user buffers of the iterator. The caller holds the lock of the device file.
+ *  In record mode the bytes are a new segment, written whole or not at all (-EFAULT) **/
+static int flow_write_iter(flow_state *flow, struct iov_iter *from, int len){
+  int result;
+  u32 head = flow->control->head;
+
+  // Write from user buffers, all the segments of the vector in the same copy
+  result = ring_copy_from_iter(flow->stream_content, flow->size, head, from, len);
+
+  if(flow->segments != NULL){
+    if(result != len) return -EFAULT;              // Not published: the bytes are overwritten by the next write
+    if(result == 0) return 0;
+    flow->segments[flow->seg_head & (flow->num_segments - 1)] = result;
+  }
+
+  // Publish the bytes: a reader that sees the new head also sees the data (and the segment, after seg_head)
+  smp_store_release(&(flow->control->head), head + result);
+  if(flow->segments != NULL) smp_store_release(&(flow->seg_head), flow->seg_head + 1);
+  if(result > 0) hist_stamp(flow, head + result);
+  return result;
+}
+
+/** Read from the flow to the user buffers of the iterator. The caller holds the lock of the device file.
+ *  In record mode only whole segments are read, as many as fit in len: -EMSGSIZE if the first one does not fit **/
+static int flow_read_iter(flow_state *flow, struct iov_iter *to, int len){
+  int result;
+  u32 tail = flow->control->tail;
+  u32 seg_tail = flow->seg_tail;
+  u32 seg_head;
+  int num = 0;
+  int bytes = 0;
+
+  if(flow->segments != NULL){
+    // seg_head is published after head: its segments are readable
+    seg_head = smp_load_acquire(&(flow->seg_head));
+    while(seg_tail + num != seg_head && bytes + flow->segments[(seg_tail + num) & (flow->num_segments - 1)] <= len){
+      bytes += flow->segments[(seg_tail + num) & (flow->num_segments - 1)];
+      num++;
+    }
+    if(num == 0) return seg_tail != seg_head ? -EMSGSIZE : 0;
+    len = bytes;
+  }
+  else if(len > flow_readable(flow)) len = flow_readable(flow);
+  if(len == 0) return 0;
+
+  // Read from file
+  result = ring_copy_to_iter(flow->stream_content, flow->size, tail, to, len);
+  if(flow->segments != NULL && result != len) return -EFAULT;      // Segments not consumed
+
+  // Release the space: a writer that sees the new tail can overwrite the bytes
+  smp_store_release(&(flow->control->tail), tail + result);
+  if(flow->segments != NULL) smp_store_release(&(flow->seg_tail), seg_tail + num);
+  hist_unstamp(flow, tail + result);
+  return result;
+}
+
+/** Read from the device file: the high priority flow is drained first, then the low priority one.
+ *  The caller holds the lock of the device file **/
+static int object_read_iter(object_state *the_object, struct iov_iter *to, int len){
+  flow_state *high = &(the_object->flows[HIGH_PRIORITY]);
+  int result;
+  int result_low;
+
+  result = flow_read_iter(high, to, len);
+  if(result < 0) return result;
+  if(result > 0){
+    stat_add(the_object, HIGH_PRIORITY, STAT_BYTES_READ, result);
+    stat_inc(the_object, HIGH_PRIORITY, STAT_READS);
+  }
+  if(result < len && flow_readable(high) == 0){
+    result_low = flow_read_iter(&(the_object->flows[LOW_PRIORITY]), to, len - result);
+    if(result_low < 0) return result > 0 ? result : result_low;
+    if(result_low > 0){
+      stat_add(the_object, LOW_PRIORITY, STAT_BYTES_READ, result_low);
+      stat_inc(the_object, LOW_PRIORITY, STAT_READS);
     }
-    buff1[len1] = '\0';
-    buff2[len2] = '\0';
+    result += result_low;
   }
+  return result;
+}
 
 
-  // Write from user buffer
-  strcpy(&(the_object->stream_content[the_object->off_write]), buff1);
-  the_object->off_write += len1;
-  
-  if(len2 > 0){
-    the_object->off_write = 0;
-    strcpy(&(the_object->stream_content[the_object->off_write]), buff2);
-    the_object->off_write += len2;
-    kfree(buff1);
-    kfree(buff2);
-  }
-  spin_unlock(&(the_object->operation_synchronizer));
-  
-  AUDIT
-  printk("%s: [Major, Minor = %d, %d] Delayed work correctly executed\n",MODNAME,major,minor);
-  
-  kfree(the_work);
+/** Deadline of a blocking operation of the session (CLOCK_MONOTONIC), 0 for not blocking operations **/
+static ktime_t session_deadline(session_state *session, bool nowait){
+  if(!session->blocking || nowait) return 0;
+  return ktime_add_us(ktime_get(), session->timeout);
+}
+
+/** Result of an operation that cannot complete without waiting: 0 for a not blocking session, -EAGAIN for a
+ *  not blocking request (IOCB_NOWAIT: RWF_NOWAIT, io_uring inline issue) of a blocking session, retried by the caller **/
+static long nowait_result(session_state *session){
+  return session->blocking ? -EAGAIN : 0;
+}
+
+/** Result of an hrtimer wait (wait_event_interruptible_hrtimeout) up to the deadline, as returned by lock_object **/
+static long hrtimeout_result(int ret){
+  if(ret == 0) return 1;
+  return ret == -ETIME ? 0 : ret;
+}
+
+/** Acquire the lock of the device file. A blocking caller sleeps on the queue, up to the deadline (hrtimer),
+ *  instead of spinning on the lock. With deadline 0 (not blocking operation) it is a single attempt.
+ *  Return 1 with the lock held, 0 if the timeout elapsed, -EAGAIN if the single attempt failed, -ERESTARTSYS on signal **/
+static long lock_object(object_state *the_object, int priority, wait_queue_head_t *queue, ktime_t deadline){
+  u64 start;
+  long ret;
+
+  if(mutex_trylock(&(the_object->operation_synchronizer))) return 1;
+  stat_inc(the_object, priority, STAT_TRYLOCK_FAILURES);
+  if(deadline == 0) return -EAGAIN;
+
+  start = hist_start();
+  ret = hrtimeout_result(wait_event_interruptible_hrtimeout(*queue, mutex_trylock(&(the_object->operation_synchronizer)),
+                                                            ktime_sub(deadline, ktime_get())));
+  hist_wait(&(the_object->flows[priority]), start);
+  return ret;
+}
+
+/** Release the lock of the device file and wake up the threads sleeping to acquire it: all the writers,
+ *  the first reader (exclusive wait) if there are bytes readable. Every path releasing the lock uses it:
+ *  a waiter whose trylock failed sleeps until the next wakeup.
+ *  The bytes are counted with the lock held: the buffers (released by the idle reclaim) can be missing **/
+static void unlock_object(object_state *the_object){
+  bool readable = the_object->controls != NULL && object_readable(the_object) > 0;
+
+  mutex_unlock(&(the_object->operation_synchronizer));
+  wake_up_interruptible(&(the_object->write_queue));
+  if(readable) wake_up_interruptible(&(the_object->read_queue));
+}
+
+/** Bytes that must be free in the flow for a write of len bytes: one for a partial write in stream mode, all of them
+ *  otherwise (record mode: never split a segment). The mode can change (IOWR_RECORDSTATE) until the lock is held **/
+static int flow_min_space(flow_state *flow, bool partial, int len){
+  return partial && READ_ONCE(flow->segments) == NULL ? 1 : len;
+}
+
+/** Acquire the lock of the device file with the bytes free in the flow for a write of len bytes (flow_min_space),
+ *  checked again with the lock held. A blocking writer releases the lock and sleeps until a reader consumes bytes of the flow.
+ *  Same return values of lock_object, -EAGAIN also if a not blocking operation finds the flow full
+ *  (counted in STAT_FULL): on success the lock is held **/
+static long lock_object_space(object_state *the_object, flow_state *flow, bool partial, int len, ktime_t deadline){
+  u64 start;
+  long ret;
+
+  ret = lock_object(the_object, flow - the_object->flows, &(the_object->write_queue), deadline);
+  while(ret > 0 && flow_free(flow) < flow_min_space(flow, partial, len)){
+    unlock_object(the_object);
+    if(deadline == 0){
+      // Not blocking operation: the flow is full
+      stat_inc(the_object, flow - the_object->flows, STAT_FULL);
+      trace_multi_flow_timeout(the_object->minor, flow - the_object->flows, true, 0);
+      audit("%s: [Major, Minor = %d, %d] File is full \n",MODNAME, Major, the_object->minor);
+      return -EAGAIN;
+    }
+    // Wait (respecting the timeout) for free space in the flow
+    start = hist_start();
+    ret = hrtimeout_result(wait_event_interruptible_hrtimeout(the_object->write_queue,
+                                                              flow_free(flow) >= flow_min_space(flow, partial, len) &&
+                                                              mutex_trylock(&(the_object->operation_synchronizer)),
+                                                              ktime_sub(deadline, ktime_get())));
+    hist_wait(flow, start);
+  }
+  return ret;
+}
+
+/** Acquire the lock of the device file with bytes readable, for a blocking reader. The readers wait exclusive, in FIFO
+ *  order: a wakeup (unlock_object) wakes only the first one and each reader leaving bytes in the flows wakes the next,
+ *  so the wakeups follow the bytes made available instead of the number of readers. The entry of the reader stays in
+ *  the queue (default wake function) until it leaves, so a reader whose trylock fails, or whose bytes are taken by
+ *  another reader, keeps its place instead of going back to the tail.
+ *  Same return values of lock_object: on success the lock is held **/
+static long lock_object_readable(object_state *the_object, ktime_t deadline){
+  DECLARE_WAITQUEUE(wait, current);
+  long ret;
+
+  add_wait_queue_exclusive(&(the_object->read_queue), &wait);
+  while(1){
+    set_current_state(TASK_INTERRUPTIBLE);
+    if(object_readable(the_object) > 0 && mutex_trylock(&(the_object->operation_synchronizer))){
+      ret = 1;
+      break;
+    }
+    if(signal_pending(current)){
+      ret = -ERESTARTSYS;
+      break;
+    }
+    if(ktime_compare(ktime_get(), deadline) >= 0){
+      ret = 0;
+      break;
+    }
+    // Woken up by a wakeup or by the hrtimer at the deadline
+    schedule_hrtimeout_range(&deadline, current->timer_slack_ns, HRTIMER_MODE_ABS);
+  }
+  __set_current_state(TASK_RUNNING);
+  remove_wait_queue(&(the_object->read_queue), &wait);
+
+  // Leaving without reading: a wakeup received for these bytes goes to the next reader
+  if(ret <= 0 && object_readable(the_object) > 0) wake_up_interruptible(&(the_object->read_queue));
+  return ret;
+}
+
+/** Count the producers (sessions open for writing) and the consumers (sessions open for reading) of the device file.
+ *  While there is at most one of each, the high priority flow is a single producer/single consumer queue and the
+ *  sessions in IOWR_SPSCSTATE skip the lock. The caller holds the lock of the device file.
+ *  Return true if the lockless mode must be turned off: the caller does it with spsc_off, after releasing the lock **/
+static bool update_spsc(object_state *the_object, fmode_t mode, int delta){
+  bool spsc;
+
+  if(mode & FMODE_WRITE) the_object->num_producers += delta;
+  if(mode & FMODE_READ) the_object->num_consumers += delta;
+  spsc = the_object->num_producers <= 1 && the_object->num_consumers <= 1;
+
+  if(spsc == the_object->spsc) return false;
+  if(spsc) WRITE_ONCE(the_object->spsc, true);
+  return !spsc;
+}
+
+/** Second producer or consumer: the lockless operations in progress end before the lock is needed again.
+ *  spsc_synchronizer is always taken before operation_synchronizer (as in lock_flow_idle): the counts are
+ *  checked again, a session can be released meanwhile **/
+static void spsc_off(object_state *the_object){
+  percpu_down_write(&(the_object->spsc_synchronizer));
+  mutex_lock(&(the_object->operation_synchronizer));
+  if(the_object->num_producers > 1 || the_object->num_consumers > 1) WRITE_ONCE(the_object->spsc, false);
+  unlock_object(the_object);
+  percpu_up_write(&(the_object->spsc_synchronizer));
+}
+
+/** Lockless write in the high priority flow: the acquire/release indices of the flow are the only synchronization
+ *  with the consumer. Return -EAGAIN if the device file is not in single producer/consumer mode (or the flow is
+ *  being resized): the caller takes the lock **/
+static ssize_t spsc_write_iter(object_state *the_object, session_state *session, struct iov_iter *from, size_t len, ktime_t deadline){
+  flow_state *flow = &(the_object->flows[HIGH_PRIORITY]);
+  ssize_t result;
+  long ret;
+  u64 start;
+
+  while(1){
+    if(!percpu_down_read_trylock(&(the_object->spsc_synchronizer))) return -EAGAIN;
+    if(!READ_ONCE(the_object->spsc)){
+      percpu_up_read(&(the_object->spsc_synchronizer));
+      return -EAGAIN;
+    }
+    // The mode of the flow is stable in the read section: IOWR_RECORDSTATE takes spsc_synchronizer (write)
+    if(flow_free(flow) >= flow_min_space(flow, session->partial, len)) break;
+    percpu_up_read(&(the_object->spsc_synchronizer));
+
+    // Not blocking operation: the flow is full. A not blocking request of a blocking session gets -EAGAIN
+    // from the locked path, the same of the other writes
+    if(deadline == 0){
+      if(session->blocking) return -EAGAIN;
+      stat_inc(the_object, HIGH_PRIORITY, STAT_FULL);
+      trace_multi_flow_timeout(the_object->minor, HIGH_PRIORITY, true, 0);
+      return 0;
+    }
+    // Wait (respecting the timeout) for free space in the flow, outside the read section
+    start = hist_start();
+    ret = hrtimeout_result(wait_event_interruptible_hrtimeout(the_object->write_queue,
+                                                              flow_free(flow) >= flow_min_space(flow, session->partial, len) ||
+                                                              !READ_ONCE(the_object->spsc),
+                                                              ktime_sub(deadline, ktime_get())));
+    hist_wait(flow, start);
+    if(ret == 0){
+      stat_inc(the_object, HIGH_PRIORITY, STAT_TIMEOUTS);
+      trace_multi_flow_timeout(the_object->minor, HIGH_PRIORITY, true, session->timeout);
+    }
+    if(ret <= 0) return ret;
+  }
+
+  if(len > flow_free(flow)) len = flow_free(flow);      // Partial write
+  result = flow_write_iter(flow, from, len);
+  percpu_up_read(&(the_object->spsc_synchronizer));
+  if(result < 0) return result;
+  stat_add(the_object, HIGH_PRIORITY, STAT_BYTES_WRITTEN, result);
+  stat_inc(the_object, HIGH_PRIORITY, STAT_WRITES);
+
+  if(wq_has_sleeper(&(the_object->read_queue))) wake_up_interruptible(&(the_object->read_queue));
+  return result;
+}
+
+/** Lockless read from the high priority flow. Return -EAGAIN if the device file is not in single producer/consumer
+ *  mode or the high priority flow is empty: the caller takes the lock (low priority flow, blocking read) **/
+static ssize_t spsc_read_iter(object_state *the_object, struct iov_iter *to, size_t len){
+  flow_state *flow = &(the_object->flows[HIGH_PRIORITY]);
+  ssize_t result;
+
+  if(!percpu_down_read_trylock(&(the_object->spsc_synchronizer))) return -EAGAIN;
+  if(!READ_ONCE(the_object->spsc) || flow_readable(flow) == 0){
+    percpu_up_read(&(the_object->spsc_synchronizer));
+    return -EAGAIN;
+  }
+  result = flow_read_iter(flow, to, min_t(size_t, len, flow->size));
+  percpu_up_read(&(the_object->spsc_synchronizer));
+  if(result < 0) return result;
+  stat_add(the_object, HIGH_PRIORITY, STAT_BYTES_READ, result);
+  stat_inc(the_object, HIGH_PRIORITY, STAT_READS);
+
+  if(wq_has_sleeper(&(the_object->write_queue))) wake_up_interruptible(&(the_object->write_queue));
+  return result;
+}
+
+/** Allocate a pending write with a buffer of at least size bytes, from the smallest size class that fits,
+ *  on the node of the delayed work committing it. GFP_NOWAIT for the not blocking requests (IOCB_NOWAIT) **/
+static packed_work *alloc_work(int size, int node, gfp_t gfp){
+  packed_work *the_work;
+  int i;
+
+  for(i=0;i<WORK_CLASSES;i++){
+    if(size <= work_class_size[i]){
+      the_work = (packed_work*)kmem_cache_alloc_node(work_caches[i], gfp, node);
+      if(the_work != NULL) the_work->size_class = i;
+      return the_work;
+    }
+  }
+
+  // Larger than the biggest class (flows bigger than one page)
+  the_work = (packed_work*)kvmalloc_node(sizeof(packed_work) + size, gfp, node);
+  if(the_work != NULL) the_work->size_class = WORK_CLASSES;
+  return the_work;
+}
+
+static void free_work(packed_work *the_work){
+  if(the_work->size_class == WORK_CLASSES) kvfree(the_work);
+  else kmem_cache_free(work_caches[the_work->size_class], the_work);
+}
+
+/** Notify the outcome of an asynchronous write, once its bytes are readable in the flow **/
+static void complete_work(packed_work *the_work){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+  the_work->iocb->ki_complete(the_work->iocb, the_work->copiedBytes);
+#else
+  the_work->iocb->ki_complete(the_work->iocb, the_work->copiedBytes, 0);
+#endif
+}
+
+/** Commit in the low priority flow the bytes of a pending write. The caller holds the lock of the device file **/
+static void commit_work(flow_state *flow, packed_work *the_work){
+  int len = the_work->copiedBytes;
+  u32 head = flow->control->head;
+
+  // Length based copy straight from the work buffer: the bytes of the message are not interpreted
+  ring_copy_in(flow->stream_content, flow->size, head, the_work->buffer, len);
+
+  // The bytes (and the slot of the segment, in record mode) reserved at enqueue time are now readable
+  flow->reserved_bytes -= len;
+  if(flow->segments != NULL){
+    flow->segments[flow->seg_head & (flow->num_segments - 1)] = len;
+    flow->reserved_segments--;
+  }
+  smp_store_release(&(flow->control->head), head + len);
+  if(flow->segments != NULL) smp_store_release(&(flow->seg_head), flow->seg_head + 1);
+  hist_stamp(flow, head + len);
+}
+
+/** Queue the delayed work of the device file in the workqueue of the driver, on the configured CPU/node,
+ *  otherwise on a CPU of the node of the buffers of the device file.
+ *  With flush the pending writes are committed now, otherwise within batch_delay us from the first one **/
+static void schedule_delayed_work_object(object_state *the_object, bool flush){
+  int cpu = WORK_CPU_UNBOUND;
+  int node = wq_node != NUMA_NO_NODE ? wq_node : the_object->node;
+  int delay = READ_ONCE(batch_delay);
+
+  if(wq_cpu >= 0) cpu = wq_cpu;
+  else if(node != NUMA_NO_NODE){
+    cpu = cpumask_any_and(cpumask_of_node(node), cpu_online_mask);
+    if(cpu >= nr_cpu_ids) cpu = WORK_CPU_UNBOUND;
+  }
+
+  if(flush || delay <= 0) mod_delayed_work_on(cpu, flow_workqueue, &(the_object->the_work), 0);
+  else queue_delayed_work_on(cpu, flow_workqueue, &(the_object->the_work), usecs_to_jiffies(delay));
+}
+
+static void commit_delayed_work(struct work_struct *work){
+  /** Delayed work of the device file: commits a batch of pending writes in FIFO order, under a single lock acquisition **/
+  object_state *the_object = container_of(to_delayed_work(work), object_state, the_work);
+  int minor = the_object->minor;
+  flow_state *flow = &(the_object->flows[LOW_PRIORITY]);
+  packed_work *the_work;
+  packed_work *next;
+  LIST_HEAD(batch);
+  int max_batch = max(READ_ONCE(batch_size), 1);
+  int num_works = 0;
+  bool more;
+  u64 now;
+
+  mutex_lock(&(the_object->operation_synchronizer));
+  list_for_each_entry_safe(the_work, next, &(the_object->pending_works), list){
+    if(num_works == max_batch) break;
+    commit_work(flow, the_work);
+    num_works++;
+    list_move_tail(&(the_work->list), &batch);
+  }
+  the_object->num_pending -= num_works;
+  the_object->committed_works += num_works;
+  more = the_object->num_pending > 0;
+  unlock_object(the_object);                // Wake up the threads in read on the wait_queue
+  if(num_works > 0) wake_up_interruptible_all(&(the_object->drain_queue));     // fsync barriers
+  now = trace_multi_flow_commit_enabled() || static_branch_unlikely(&hist_key) ? ktime_get_ns() : 0;
+
+  // Batch limit reached: commit the remaining writes in the next execution
+  if(more) schedule_delayed_work_object(the_object, true);
+
+  audit("%s: [Major, Minor = %d, %d] Delayed work correctly executed, %d writes committed\n",MODNAME,Major,minor,num_works);
+
+  list_for_each_entry_safe(the_work, next, &batch, list){
+    if(now && the_work->enqueued){
+      trace_multi_flow_commit(minor, LOW_PRIORITY, the_work->copiedBytes, now - the_work->enqueued);
+      if(flow->hist != NULL) hist_record(flow->hist, HIST_COMMIT, now - the_work->enqueued);
+    }
+    if(the_work->iocb != NULL) complete_work(the_work);
+    free_work(the_work);
+  }
+}
+
+/** Idle reclaim of the device file: the buffers of a minor without sessions, mappings and bytes are released,
+ *  the next open allocates them again (ring_size bytes) **/
+static void reclaim_delayed_work(struct work_struct *work){
+  object_state *the_object = container_of(to_delayed_work(work), object_state, reclaim_work);
+  int minor = the_object->minor;
+
+  mutex_lock(&(the_object->operation_synchronizer));
+  if(the_object->controls != NULL && the_object->num_sessions == 0 && atomic_read(&(the_object->num_mappings)) == 0 &&
+     the_object->num_pending == 0 && object_readable(the_object) == 0){
+    free_object(the_object);
+
+    audit("%s: [Major, Minor = %d, %d] Idle device file, buffers released\n",MODNAME,Major,minor);
+  }
+  unlock_object(the_object);
+}
+
+/** Release the state of a device file without buffers (never opened, or at unload after free_object) **/
+static void destroy_object(object_state *the_object){
+  int j;
+
+  percpu_free_rwsem(&(the_object->spsc_synchronizer));
+  free_percpu(the_object->stats);
+  for(j=0;j<NUM_FLOWS;j++){
+    kfree(the_object->flows[j].hist);
+  }
+  kmem_cache_free(object_cache, the_object);
 }
 
-ssize_t dev_write(struct file *filp, const char *buff, size_t len, loff_t *off) {
+/** Device file of the minor, created (without buffers) if this is the first open of the minor.
+ *  Concurrent first opens race on the insertion in objects: the loser releases its copy **/
+static object_state *create_object(int minor){
+  object_state *the_object = get_object(minor);
+  int ret;
+  int j;
+
+  if(the_object != NULL) return the_object;
+
+  the_object = kmem_cache_alloc_node(object_cache, GFP_KERNEL | __GFP_ZERO, minor_node(minor));
+  if(the_object == NULL) return NULL;
+  the_object->stats = alloc_percpu(object_stats);
+  if(the_object->stats == NULL || percpu_init_rwsem(&(the_object->spsc_synchronizer)) != 0){
+    free_percpu(the_object->stats);
+    kmem_cache_free(object_cache, the_object);
+    return NULL;
+  }
+  mutex_init(&(the_object->operation_synchronizer));
+  mutex_init(&(the_object->mapping_synchronizer));
+  atomic_set(&(the_object->num_mappings), 0);
+  the_object->controls = NULL;                 // Buffers allocated on the first open
+  for(j=0;j<NUM_FLOWS;j++){
+    the_object->flows[j].size = ring_size;
+  }
+  INIT_LIST_HEAD(&(the_object->pending_works));
+  INIT_DELAYED_WORK(&(the_object->the_work), commit_delayed_work);
+  INIT_DELAYED_WORK(&(the_object->reclaim_work), reclaim_delayed_work);
+  the_object->node = NUMA_NO_NODE;
+  the_object->spsc = true;
+  the_object->minor = minor;
+  atomic_set(&(the_object->num_readers), 0);
+  init_waitqueue_head(&(the_object->read_queue));    // Initialize the wait_queues
+  init_waitqueue_head(&(the_object->write_queue));
+  init_waitqueue_head(&(the_object->drain_queue));
+
+  ret = xa_insert(&objects, minor, the_object, GFP_KERNEL);
+  if(ret != 0){
+    destroy_object(the_object);
+    return ret == -EBUSY ? get_object(minor) : NULL;
+  }
+  return the_object;
+}
+
+/** Write on the device file: one call for all the segments of the vector (write/writev/io_uring),
+ *  a single lock acquisition and, for the low priority flow, a single delayed write **/
+static ssize_t do_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+  struct file *filp = iocb->ki_filp;
+  size_t len = iov_iter_count(from);
   int minor;
-  int ret = -1;
+  long ret;
   int result = 0;
   object_state *the_object;
-  int size_task;
-  bool blocking;
-  int len_2nd = 0;               // For 2nd write if offset > OBJECT_MAX_SIZE (4096). Implemented for circular buffer
+  session_state *session = filp->private_data;
+  ktime_t deadline;
 
   minor = get_minor(filp);
-  the_object = objects + minor;
-  blocking = the_object->blocking;
+  the_object = session->object;
+  deadline = session_deadline(session, iocb->ki_flags & IOCB_NOWAIT);   // Not blocking operations only try the lock
 
-  AUDIT
-  printk("%s: [Major, Minor = %d, %d] Somebody called a write\n",MODNAME,get_major(filp),minor);
+  audit("%s: [Major, Minor = %d, %d] Somebody called a write\n",MODNAME,get_major(filp),minor);
 
-  if(the_object->priority){
+  if(session->priority){
     // HIGH PRIORITY
-    if(blocking){
-      // BLOCKING OPERATION
-
-      // Initilialize timer
-      u64 diff;
-      long long int jiffies_timer = (long long int) (get_jiffies_64() + msecs_to_jiffies(the_object->timeout));
-
-      while(1){
-        diff = jiffies_timer - (long long int)get_jiffies_64();
-        if(diff < 0){
-          // Timeout check
-          printk("%s: [Major, Minor = %d, %d] Write timeout elapsed for thread :%d\n", MODNAME, Major, minor, current->pid);
-          break;
-        }
-        ret = spin_trylock(&(the_object->operation_synchronizer));
-        if(ret != 0) {
-          if(numBytes[minor]+len >= OBJECT_MAX_SIZE){   // (DEV) Forse usare read di atomic
-            // The file is full
-            result = 0;
-            goto exit_write;
-          }
-
-          if((OBJECT_MAX_SIZE - the_object->off_write) < len) {
-              // 2nd write if offset overflow limit page (circular buffer)
-              len_2nd = len + the_object->off_write - OBJECT_MAX_SIZE;
-              len = OBJECT_MAX_SIZE - the_object->off_write;
-          }
-
-          // Write from user buffer
-          ret = copy_from_user(&(the_object->stream_content[the_object->off_write]),buff,len);
-          the_object->off_write += (len - ret); 
-          result += len - ret;
-          
-          if(len_2nd > 0 && result == len){
-            the_object->off_write=0;
-            ret = copy_from_user(&(the_object->stream_content[the_object->off_write]),&buff[result],len_2nd);
-            the_object->off_write += len_2nd - ret;
-            result += len_2nd - ret;
-          }
-          goto exit_write;
+    flow_state *flow = &(the_object->flows[HIGH_PRIORITY]);
+    bool partial = session->partial && READ_ONCE(flow->segments) == NULL;     // Record mode: whole segments only (checked again with the lock)
 
-        }
-      }
-    }
-    else{
-      // NOT BLOCKING OPERATION
-      ret = spin_trylock(&(the_object->operation_synchronizer));
-      if(ret != 0) {
-        if(numBytes[minor]+len >= OBJECT_MAX_SIZE){
-          // The file is full
-          spin_unlock(&(the_object->operation_synchronizer));
-          result = 0;
-          return result;
-        }
+    // The message can never fit in the flow
+    if(!partial && len > READ_ONCE(flow->size)) return 0;
 
-        if((OBJECT_MAX_SIZE - the_object->off_write) < len) {
-            len_2nd = len + the_object->off_write - OBJECT_MAX_SIZE;
-            len = OBJECT_MAX_SIZE - the_object->off_write;
-        }
+    if(session->spsc){
+      result = spsc_write_iter(the_object, session, from, len, deadline);
+      if(result != -EAGAIN) return result;
+    }
 
-        // Write from user buffer
-        ret = copy_from_user(&(the_object->stream_content[the_object->off_write]),buff,len);
-        the_object->off_write += (len - ret);
-        result += len - ret;
-        
-        if(len_2nd > 0 && result == len){
-          // 2nd write if offset overflow limit page (circular buffer)
-          the_object->off_write=0;
-          ret = copy_from_user(&(the_object->stream_content[the_object->off_write]),&buff[result],len_2nd);
-          the_object->off_write += len_2nd - ret;
-          result += len_2nd - ret;
-        }
-        goto exit_write;
+    ret = lock_object_space(the_object, flow, session->partial, len, deadline);
+    if(ret <= 0){
+      if(ret == 0){
+        stat_inc(the_object, HIGH_PRIORITY, STAT_TIMEOUTS);
+        trace_multi_flow_timeout(minor, HIGH_PRIORITY, true, session->timeout);
+        audit("%s: [Major, Minor = %d, %d] Write timeout elapsed for thread :%d\n", MODNAME, Major, minor, current->pid);
       }
+      return ret == -EAGAIN ? nowait_result(session) : ret;          // Lock busy or flow full: nothing written
     }
-  exit_write:
-    if(result > 0) atomic_add(result, (atomic_t*)&numBytes[minor]);
-    spin_unlock(&(the_object->operation_synchronizer));
 
-    wake_up(&read_queues[minor]);// Wake up the threads in read on the wait_queue
+    if(len > flow_free(flow)) len = flow_free(flow);      // Partial write
+    result = flow_write_iter(flow, from, len);
+    unlock_object(the_object);         // Wake up the threads in read on the wait_queue
+    if(result < 0) return result;
+    stat_add(the_object, HIGH_PRIORITY, STAT_BYTES_WRITTEN, result);
+    stat_inc(the_object, HIGH_PRIORITY, STAT_WRITES);
     return result;
   }
 
   else{
     // LOW PRIORITY
     packed_work *the_task;
+    flow_state *flow = &(the_object->flows[LOW_PRIORITY]);
+    bool partial = session->partial && READ_ONCE(flow->segments) == NULL;     // Record mode: whole segments only (checked again with the lock)
+    bool flush;
 
-    //size_task = sizeof(int)*5 + sizeof(struct work_struct) + sizeof(bool) + sizeof(char) * (len+1);   //offset of the buff inside the packed_work
-    size_task = sizeof(packed_work)+ sizeof(char) * (len+1);
-    the_task = (packed_work*)kzalloc(size_task,GFP_ATOMIC);    //non blocking memory allocation
+    // The message can never fit in the flow
+    if(!partial && len > READ_ONCE(flow->size)) return 0;
+    if(len > READ_ONCE(flow->size)) len = READ_ONCE(flow->size);        // Partial write: no more than the flow can hold
+
+    // Process context: the slab allocation can sleep, unless the request must not wait
+    the_task = alloc_work(len, the_object->node, iocb->ki_flags & IOCB_NOWAIT ? GFP_NOWAIT : GFP_KERNEL);
 
     if (the_task == NULL) {
+      stat_inc(the_object, LOW_PRIORITY, STAT_ALLOC_FAILURES);
+      if(iocb->ki_flags & IOCB_NOWAIT) return -EAGAIN;      // Retried by the caller with GFP_KERNEL
       AUDITERROR
       printk("%s: [Major, Minor = %d, %d] Tasklet buffer allocation failure\n",MODNAME, get_major(filp),minor);
-      kfree(the_task);
-      return -1;
+      return -ENOMEM;
     }
 
-    // copy user buffer inside temporary buffer of delayed work
-    result = copy_from_user(&(the_task->buffer),buff,len);
-    the_task->buffer[len - result] = '\0';   // Put string terminator
-    the_task->copiedBytes = len - result;       
-    the_task->major = get_major(filp);
-    the_task->minor = minor;
-
-    if(blocking){
-      // BLOCKING OPERATION
-
-      // Initilialize timer
-      long long int diff;
-      long long int jiffies_timer = (long long int) (get_jiffies_64() + msecs_to_jiffies(the_object->timeout));
-      while(1){
-        diff = jiffies_timer - (long long int)get_jiffies_64();
-        if(diff < 0){
-          // Timeout check
-          printk("%s: [Major, Minor = %d, %d] Write timeout elapsed for thread :%d\n", MODNAME, Major, minor, current->pid);
-          goto dealloc_task;
-        }
-        ret = spin_trylock(&(the_object->operation_synchronizer));
-        if(ret != 0) {
-          if(numBytes[minor]+len >= OBJECT_MAX_SIZE){   // (DEV) Forse usare read di atomic
-            // The file is full
-            spin_unlock(&(the_object->operation_synchronizer));
-            printk("%s: [Major, Minor = %d, %d] File is full \n",MODNAME, get_major(filp), minor);
-            goto dealloc_task;
-          }
-          result = len - result;
-          atomic_add(result, (atomic_t*)&numBytes[minor]);
-          spin_unlock(&(the_object->operation_synchronizer));
-          break;
-        }
+    // copy user buffers inside temporary buffer of delayed work, the whole vector in one work
+    the_task->copiedBytes = copy_from_iter(&(the_task->buffer),len,from);
+    the_task->iocb = is_sync_kiocb(iocb) ? NULL : iocb;
+    the_task->enqueued = trace_multi_flow_commit_enabled() || static_branch_unlikely(&hist_key) ? ktime_get_ns() : 0;
+
+    ret = lock_object_space(the_object, flow, session->partial, the_task->copiedBytes, deadline);
+    if(ret <= 0){
+      if(ret == 0){
+        stat_inc(the_object, LOW_PRIORITY, STAT_TIMEOUTS);
+        trace_multi_flow_timeout(minor, LOW_PRIORITY, true, session->timeout);
+        audit("%s: [Major, Minor = %d, %d] Write timeout elapsed for thread :%d\n", MODNAME, Major, minor, current->pid);
       }
+      free_work(the_task);
+      return ret == -EAGAIN ? nowait_result(session) : ret;          // Lock busy or flow full: nothing written
     }
 
-    else{
-      // NOT BLOCKING OPERATION
-      ret = spin_trylock(&(the_object->operation_synchronizer));
-      if(ret != 0) {
-        if(numBytes[minor]+len >= OBJECT_MAX_SIZE){
-          // The file is full
-          spin_unlock(&(the_object->operation_synchronizer));
-          printk("%s: [Major, Minor = %d, %d] File is full \n",MODNAME, get_major(filp), minor);
-          goto dealloc_task;
-        }
-        result = len - result;
-        atomic_add(result, (atomic_t*)&numBytes[minor]);
-        spin_unlock(&(the_object->operation_synchronizer));
+    if(flow->segments != NULL){
+      // Record mode: the segment is committed whole, in its own slot of the index
+      if(the_task->copiedBytes != len || len == 0){
+        unlock_object(the_object);
+        free_work(the_task);
+        return len == 0 ? 0 : -EFAULT;
       }
-      else goto dealloc_task;
+      flow->reserved_segments++;
     }
-
-    AUDIT
-    printk("%s: [Major, Minor = %d, %d] Work buffer allocation success - the address is %p\n",MODNAME, get_major(filp), minor, the_task);
-
-    __INIT_WORK(&(the_task->the_work),(void*)delayed_work,(unsigned long)(&(the_task->the_work)));
-    schedule_work(&the_task->the_work);                                // schedule in the work queue the asyncro write process
-    return result;
-
-dealloc_task:
-    kfree(the_task);       // deallocate the delayed task struct
+    if(the_task->copiedBytes > flow_free(flow)) the_task->copiedBytes = flow_free(flow);      // Partial write
+    result = the_task->copiedBytes;
+    flow->reserved_bytes += result;         // Bytes reserved for the delayed work, readable after the commit
+    list_add_tail(&(the_task->list), &(the_object->pending_works));    // Same order of the reservations
+    flush = ++the_object->num_pending >= READ_ONCE(batch_size);        // Batch full: no more delay
+    session->last_work = ++the_object->queued_works;
+    trace_multi_flow_enqueue(minor, result, the_object->num_pending);
+    unlock_object(the_object);
+    stat_add(the_object, LOW_PRIORITY, STAT_BYTES_WRITTEN, result);
+    stat_inc(the_object, LOW_PRIORITY, STAT_WRITES);
+
+    audit("%s: [Major, Minor = %d, %d] Work buffer allocation success - the address is %p\n",MODNAME, get_major(filp), minor, the_task);
+
+    schedule_delayed_work_object(the_object, flush);  // schedule in the work queue the asyncro write process
+
+    // Asynchronous request: the outcome is notified by the delayed work with ki_complete
+    if(!is_sync_kiocb(iocb)) return -EIOCBQUEUED;
     return result;
   }
   return -1;
 }
 
 
-static ssize_t dev_read(struct file *filp, char *buff, size_t len, loff_t *off) {
+/** Write on the device file, traced (multi_flow_write) with the latency of the call **/
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+  session_state *session = iocb->ki_filp->private_data;
+  u64 start = trace_multi_flow_write_enabled() ? ktime_get_ns() : 0;
+  ssize_t result = do_write_iter(iocb, from);
 
+  if(start) trace_multi_flow_write(get_minor(iocb->ki_filp), session->priority, result, ktime_get_ns() - start);
+  return result;
+}
+
+/** Read from the device file: one call for all the segments of the vector (read/readv/io_uring) **/
+static ssize_t do_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+
+  struct file *filp = iocb->ki_filp;
+  size_t len = iov_iter_count(to);
   int minor = get_minor(filp);
-  int ret;
+  long ret;
   int result = 0;
   object_state *the_object;
-  int len_2nd = 0;           // For 2nd read if offset > OBJECT_MAX_SIZE (4096). Implemented for circular buffer
-  the_object = objects + minor;
+  session_state *session = filp->private_data;
+  u64 start;
+  the_object = session->object;
 
-  AUDIT
-  printk("%s: [Major, Minor = %d, %d] Somebody called a read\n",MODNAME,get_major(filp),minor);
+  audit("%s: [Major, Minor = %d, %d] Somebody called a read\n",MODNAME,get_major(filp),minor);
 
-  atomic_inc((atomic_t*)&numReaders[minor]);
-
-  // IF BLOCKING operations
-  if(the_object->blocking){
-    // Initilialize timer
-    long long int jiffies_timer = (long long int)(get_jiffies_64() + msecs_to_jiffies(the_object->timeout));
-    long long int diff;
-    while(1){
-      // Timeout check
-      diff = jiffies_timer - (long long int) get_jiffies_64();
-      if(diff < 0){
-        AUDIT
-        printk("%s: [Major, Minor = %d, %d] Timeout elapsed for thread %d\n", MODNAME, get_major(filp), minor, current->pid);
-        break;
-      }
-      if(the_object->off_write - the_object->off_read <= 0){
-        // Wait (respecting the timeout) for new bytes written to the device file
-        ret = wait_event_timeout(read_queues[minor], the_object->off_write - the_object->off_read > 0 && numBytes[minor] > 0, (u64) diff);
-        if(ret == 0){ 
-          AUDIT
-          printk("%s: [Major, Minor = %d, %d] Read timeout elapsed for thread %d\n", MODNAME, get_major(filp), minor, current->pid);
-          break;
-        }
-      }
+  if(session->spsc){
+    result = spsc_read_iter(the_object, to, len);
+    if(result != -EAGAIN) return result;
+    result = 0;
+  }
 
-      ret = spin_trylock(&(the_object->operation_synchronizer));
-      if(ret != 0){
-        if(the_object->off_write - the_object->off_read == 0){
-          spin_unlock(&(the_object->operation_synchronizer));
-          continue;
-        }
-        if((OBJECT_MAX_SIZE - the_object->off_read) < len) {
-            // 2nd write if offset overflow limit page (circular buffer)
-            len_2nd = len + the_object->off_read - OBJECT_MAX_SIZE;
-            len = OBJECT_MAX_SIZE - the_object->off_read;
-        }
-        // Read from file
-        ret = copy_to_user(buff,&(the_object->stream_content[the_object->off_read]),len);
-        the_object->off_read += (len - ret);
-        result += len - ret;
-        
-        if(len_2nd > 0 && result == len){
-          the_object->off_read = 0;
-          ret = copy_to_user(&buff[result], &(the_object->stream_content[the_object->off_read]), len_2nd);
-          the_object->off_read += len_2nd - ret;
-          result += len_2nd - ret;
-        }
-        spin_unlock(&(the_object->operation_synchronizer));
+  atomic_inc(&(the_object->num_readers));
 
-        if(result == len){
-          // Read operation is completed
-          break;
-        }
+  // IF BLOCKING operations
+  if(session->blocking && !(iocb->ki_flags & IOCB_NOWAIT)){
+    // Sleep (respecting the timeout) until there are bytes in one of the flows and the lock is free
+    start = hist_start();
+    ret = lock_object_readable(the_object, session_deadline(session, false));
+    hist_wait(&(the_object->flows[session->priority]), start);
+    if(ret <= 0){
+      if(ret == 0){
+        stat_inc(the_object, session->priority, STAT_TIMEOUTS);
+        trace_multi_flow_timeout(minor, session->priority, false, session->timeout);
+        audit("%s: [Major, Minor = %d, %d] Read timeout elapsed for thread %d\n", MODNAME, get_major(filp), minor, current->pid);
       }
+      result = ret;
+      goto exit_read;
     }
-    atomic_dec((atomic_t*)&numReaders[minor]);                        // Decrement number of readers
-    if(result > 0) atomic_sub(result, (atomic_t*)&numBytes[minor]);   // Decrement number readable bytes
-    return result;
   }
 
   // IF NO BLOCKING operations
   else{
-    ret = spin_trylock(&(the_object->operation_synchronizer));
-    if(ret != 0){
-      if(the_object->off_write - the_object->off_read == 0){
-          spin_unlock(&(the_object->operation_synchronizer));
-          goto exit_read;
-      }
-      if((OBJECT_MAX_SIZE - the_object->off_read) < len) {
-          // 2nd write if offset overflow limit page (circular buffer)
-          len_2nd = len + the_object->off_read - OBJECT_MAX_SIZE;
-          len = OBJECT_MAX_SIZE - the_object->off_read;
-        }
+    if(!mutex_trylock(&(the_object->operation_synchronizer))){
+      stat_inc(the_object, session->priority, STAT_TRYLOCK_FAILURES);
+      result = nowait_result(session);
+      goto exit_read;
+    }
+  }
+
+  // Read from file, high priority flow first (never more than the two flows can hold)
+  result = object_read_iter(the_object, to, min_t(size_t, len, the_object->flows[HIGH_PRIORITY].size + the_object->flows[LOW_PRIORITY].size));
+  unlock_object(the_object);
+  // Not blocking request of a blocking session with nothing readable: not an end of file
+  if(result == 0 && len > 0 && session->blocking && (iocb->ki_flags & IOCB_NOWAIT)) result = -EAGAIN;
 
-        // Read from file
-        ret = copy_to_user(buff, &(the_object->stream_content[the_object->off_read]), len);
-        the_object->off_read += (len - ret);
-        result += len - ret;
-        
-        if(len_2nd > 0 && result == len){
-          the_object->off_read = 0;
-          ret = copy_to_user(&buff[result], &(the_object->stream_content[the_object->off_read]),len_2nd);
-          the_object->off_read += len_2nd - ret;
-          result += len_2nd - ret;
-        }
-        spin_unlock(&(the_object->operation_synchronizer));
-      }
 exit_read:
-      atomic_dec((atomic_t*)&numReaders[minor]);                        // Decrement number of readers
-      if(result > 0) atomic_sub(result, (atomic_t*)&numBytes[minor]);   // Decrement number readable bytes
-      return result;
+  atomic_dec(&(the_object->num_readers));                           // Decrement number of readers
+  return result;
+}
+
+/** Read from the device file, traced (multi_flow_read) with the latency of the call **/
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+  session_state *session = iocb->ki_filp->private_data;
+  u64 start = trace_multi_flow_read_enabled() ? ktime_get_ns() : 0;
+  ssize_t result = do_read_iter(iocb, to);
+
+  if(start) trace_multi_flow_read(get_minor(iocb->ki_filp), session->priority, result, ktime_get_ns() - start);
+  return result;
+}
+
+/** All the low priority writes up to the ticket committed by the delayed work (free running counters) **/
+static bool works_committed(object_state *the_object, u32 ticket){
+  return (s32)(READ_ONCE(the_object->committed_works) - ticket) >= 0;
+}
+
+/** Barrier of the low priority flow (fsync): wait until every write the session queued has been committed by the
+ *  delayed work, which is run now instead of after the batch delay. The writes are committed in FIFO order, so the
+ *  barrier is reached when the count of the commits passes the ticket of the last write of the session.
+ *  A blocking session waits up to its timeout (-ETIMEDOUT), a not blocking one gets -EAGAIN after the work is kicked **/
+static int dev_fsync(struct file *filp, loff_t start, loff_t end, int datasync){
+  session_state *session = filp->private_data;
+  object_state *the_object = session->object;
+  u32 ticket = READ_ONCE(session->last_work);
+  int ret;
+
+  if(works_committed(the_object, ticket)) return 0;
+  schedule_delayed_work_object(the_object, true);     // Also for a not blocking session polling the barrier
+  if(!session->blocking) return -EAGAIN;
+
+  ret = wait_event_interruptible_hrtimeout(the_object->drain_queue, works_committed(the_object, ticket),
+                                           us_to_ktime(session->timeout));
+  if(ret == -ETIME){
+    audit("%s: [Major, Minor = %d, %d] fsync timeout elapsed for thread %d\n", MODNAME, get_major(filp), get_minor(filp), current->pid);
+    return -ETIMEDOUT;
+  }
+  return ret;
+}
+
+/** Readiness of the device file for poll/epoll:
+ *  EPOLLIN bytes readable in one of the flows, EPOLLPRI bytes readable in the high priority flow,
+ *  EPOLLOUT free space in the flow selected by the priority of the session **/
+static __poll_t dev_poll(struct file *filp, poll_table *wait) {
+  session_state *session = filp->private_data;
+  object_state *the_object = session->object;
+  __poll_t mask = 0;
+
+  poll_wait(filp, &(the_object->read_queue), wait);
+  poll_wait(filp, &(the_object->write_queue), wait);
+
+  if(object_readable(the_object) > 0) mask |= EPOLLIN | EPOLLRDNORM;
+  if(flow_readable(&(the_object->flows[HIGH_PRIORITY])) > 0) mask |= EPOLLPRI;
+  if(flow_free(&(the_object->flows[session->priority ? HIGH_PRIORITY : LOW_PRIORITY])) > 0) mask |= EPOLLOUT | EPOLLWRNORM;
+
+  return mask;
+}
+
+/** Page of the device file mapping at page offset pgoff **/
+static struct page *mmap_page(object_state *the_object, unsigned long pgoff){
+  flow_state *high = &(the_object->flows[HIGH_PRIORITY]);
+  unsigned long high_pages = high->size >> PAGE_SHIFT;
+  char *addr;
+
+  if(pgoff == MMAP_CONTROL_PAGE) return virt_to_page(the_object->controls);
+  pgoff -= MMAP_HIGH_PAGE;
+  if(pgoff < high_pages) addr = high->stream_content + (pgoff << PAGE_SHIFT);
+  else addr = the_object->flows[LOW_PRIORITY].stream_content + ((pgoff - high_pages) << PAGE_SHIFT);
+
+  return is_vmalloc_addr(addr) ? vmalloc_to_page(addr) : virt_to_page(addr);
+}
+
+static void dev_vma_open(struct vm_area_struct *vma){
+  object_state *the_object = vma->vm_private_data;
+
+  atomic_inc(&(the_object->num_mappings));
+}
+
+static void dev_vma_close(struct vm_area_struct *vma){
+  object_state *the_object = vma->vm_private_data;
+
+  atomic_dec(&(the_object->num_mappings));
+}
+
+static const struct vm_operations_struct dev_vm_ops = {
+  .open = dev_vma_open,
+  .close = dev_vma_close,
+};
+
+/** Map the device file in user space, for zero copy producers and consumers:
+ *  page 0 control page (flow_control of the flows, indexed by priority), then the buffer of the high priority flow,
+ *  then the buffer of the low priority flow. A mapped producer (consumer) moves head (tail) of the flow with release
+ *  semantics and must be the only writer (reader) of that flow; IOWR_MMAPNOTIFY wakes up the sleeping threads.
+ *  The buffers of a mapped device file cannot be resized, and flows in record mode cannot be mapped **/
+static int dev_mmap(struct file *filp, struct vm_area_struct *vma) {
+  int minor = get_minor(filp);
+  session_state *session = filp->private_data;
+  object_state *the_object = session->object;
+  unsigned long pages = vma_pages(vma);
+  unsigned long addr = vma->vm_start;
+  unsigned long max_pages;
+  unsigned long i;
+  int ret = 0;
+
+  mutex_lock(&(the_object->mapping_synchronizer));
+  if(the_object->flows[HIGH_PRIORITY].segments != NULL || the_object->flows[LOW_PRIORITY].segments != NULL){
+    AUDITERROR
+    printk("%s: [Major, Minor = %d, %d] Error in mmap, a flow is in record mode\n",MODNAME, get_major(filp), minor);
+    ret = -EINVAL;
+    goto exit_mmap;
+  }
+  max_pages = 1 + ((the_object->flows[HIGH_PRIORITY].size + the_object->flows[LOW_PRIORITY].size) >> PAGE_SHIFT);
+  if(vma->vm_pgoff + pages > max_pages){
+    AUDITERROR
+    printk("%s: [Major, Minor = %d, %d] Error in mmap, the mapping is too large\n",MODNAME, get_major(filp), minor);
+    ret = -EINVAL;
+    goto exit_mmap;
+  }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+  vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+
+  for(i=0;i<pages;i++){
+    ret = vm_insert_page(vma, addr + i * PAGE_SIZE, mmap_page(the_object, vma->vm_pgoff + i));
+    if(ret != 0) goto exit_mmap;
+  }
+  vma->vm_private_data = the_object;
+  vma->vm_ops = &dev_vm_ops;
+  dev_vma_open(vma);
+
+  audit("%s: [Major, Minor = %d, %d] Device file mapped, %lu pages\n",MODNAME, get_major(filp), minor, pages);
+
+exit_mmap:
+  mutex_unlock(&(the_object->mapping_synchronizer));
+  return ret;
+}
+
+/** Acquire the locks to reconfigure a flow of the device file: no lockless operation, no user space mapping,
+ *  no readable byte and no pending delayed write. Return 0 with the locks held, -EBUSY otherwise **/
+static int lock_flow_idle(object_state *the_object, flow_state *flow){
+  percpu_down_write(&(the_object->spsc_synchronizer));
+
+  // mmap runs with mmap_lock held and takes mapping_synchronizer: only try it, to not invert the order
+  // with the copies from/to user space (page faults) done holding operation_synchronizer
+  mutex_lock(&(the_object->operation_synchronizer));
+  if(!mutex_trylock(&(the_object->mapping_synchronizer))){
+    unlock_object(the_object);
+    percpu_up_write(&(the_object->spsc_synchronizer));
+    return -EBUSY;
+  }
+  if(atomic_read(&(the_object->num_mappings)) > 0 || flow_readable(flow) > 0 || flow->reserved_bytes > 0){
+    mutex_unlock(&(the_object->mapping_synchronizer));
+    unlock_object(the_object);
+    percpu_up_write(&(the_object->spsc_synchronizer));
+    return -EBUSY;
+  }
+  return 0;
+}
+
+static void unlock_flow_idle(object_state *the_object){
+  mutex_unlock(&(the_object->mapping_synchronizer));
+  unlock_object(the_object);            // Wake up the writers waiting for space
+  percpu_up_write(&(the_object->spsc_synchronizer));
+}
+
+/** Change the size of a flow of the device file (rounded up to a power of two). Only an idle flow in stream mode
+ *  can be resized **/
+static int resize_flow(object_state *the_object, int priority, int size){
+  flow_state *flow = &(the_object->flows[priority]);
+  char *ring;
+  int old_size;
+  int ret;
+
+  if(size < RING_MIN_SIZE || size > RING_MAX_SIZE) return -EINVAL;
+  size = roundup_pow_of_two(size);
+
+  ring = alloc_ring(size, the_object->node);
+  if(ring == NULL) return -ENOMEM;
+
+  ret = lock_flow_idle(the_object, flow);
+  if(ret == 0 && flow->segments != NULL){
+    unlock_flow_idle(the_object);
+    ret = -EBUSY;                       // The segment index is sized on the buffer
+  }
+  if(ret != 0){
+    free_ring(ring, size);
+    return ret;
+  }
+
+  swap(flow->stream_content, ring);
+  old_size = flow->size;
+  WRITE_ONCE(flow->size, size);
+  flow->control->size = size;
+  hist_reset_stamps(flow);
+
+  unlock_flow_idle(the_object);
+  free_ring(ring, old_size);
+  return 0;
+}
+
+/** Switch a flow of the device file between stream mode and record mode: each write is a segment, reads return
+ *  whole segments. Only an idle flow can be switched; the segment index is not shared with user space mappings **/
+static int record_flow(object_state *the_object, int priority, bool record){
+  flow_state *flow = &(the_object->flows[priority]);
+  u32 *segments = NULL;
+  int ret;
+
+  ret = lock_flow_idle(the_object, flow);
+  if(ret != 0) return ret;
+
+  if(record && flow->segments == NULL){
+    flow->num_segments = max(flow->size / RECORD_AVG_SIZE, RECORD_MIN_SEGMENTS);
+    segments = kvmalloc_node(flow->num_segments * sizeof(u32), GFP_KERNEL, the_object->node);
+    if(segments == NULL) ret = -ENOMEM;
+    else{
+      flow->seg_head = 0;
+      flow->seg_tail = 0;
+      flow->reserved_segments = 0;
+      WRITE_ONCE(flow->segments, segments);
     }
+    segments = NULL;
+  }
+  else if(!record){
+    segments = flow->segments;
+    WRITE_ONCE(flow->segments, NULL);
+  }
+
+  unlock_flow_idle(the_object);
+  kvfree(segments);
+  return ret;
+}
+
+/** Apply all the settings of the session, only if every one is valid **/
+static int ioctl_session_config(struct file *filp, session_config __user *param){
+  session_state *session = filp->private_data;
+  session_config config;
+
+  if(copy_from_user(&config, param, sizeof(config)) != 0) return -EFAULT;
+  if((config.priority & ~1) || (config.blocking & ~1) || (config.partial & ~1) || (config.spsc & ~1) || config.timeout <= 0){
+    AUDITERROR
+    printk("%s: [Major, Minor = %d, %d] Error in ioctl, invalid session settings\n", MODNAME, get_major(filp), get_minor(filp));
+    return -EINVAL;
   }
 
+  session->priority = config.priority;
+  session->blocking = config.blocking;
+  session->partial = config.partial;
+  session->spsc = config.spsc;
+  session->timeout = config.timeout;
+  return 0;
+}
+
+/** Copy to user space the state of the flows of the device file, without taking the lock (snapshot) **/
+static int ioctl_flow_status(struct file *filp, flow_status __user *param){
+  session_state *session = filp->private_data;
+  object_state *the_object = session->object;
+  flow_status status;
+  int i;
+
+  for(i=0;i<NUM_FLOWS;i++){
+    status.readable[i] = flow_readable(&(the_object->flows[i]));
+    status.free[i] = flow_free(&(the_object->flows[i]));
+    status.size[i] = READ_ONCE(the_object->flows[i].size);
+  }
+  status.num_readers = atomic_read(&(the_object->num_readers));
+  status.num_pending = READ_ONCE(the_object->num_pending);
+  status.pending_bytes = READ_ONCE(the_object->flows[LOW_PRIORITY].reserved_bytes);
+
+  return copy_to_user(param, &status, sizeof(status)) != 0 ? -EFAULT : 0;
+}
+
 static long dev_ioctl(struct file *filp, unsigned int command, unsigned long param) {
   int minor;
   int ret;
   int value;
-  object_state *the_object;
+  session_state *session = filp->private_data;
 
   minor = get_minor(filp);
-  the_object = objects + minor;
+
+  // Commands without an int input value
+  switch(command){
+    // Set all the settings of the session in one call
+    case IOWR_SESSIONCONFIG:
+      audit("%s: [Major, Minor = %d, %d] Somebody called an ioctl for session settings\n",MODNAME,get_major(filp),minor);
+      return ioctl_session_config(filp, (session_config __user *)param);
+
+    // Bytes, free space, waiting readers and pending writes of the flows
+    case IOR_FLOWSTATUS:
+      return ioctl_flow_status(filp, (flow_status __user *)param);
+
+    // Bytes readable in the device file (both flows): size of the next read
+    case FIONREAD:
+      return put_user(object_readable(session->object), (int __user *)param);
+  }
 
   ret = copy_from_user(&value, (int*)param, sizeof(int)); 
   if(ret != 0){
@@ -522,39 +1765,112 @@ static long dev_ioctl(struct file *filp, unsigned int command, unsigned long par
   // PARAM 0 (low priority) or 1 (high priority)
   switch(command){
     case IOWR_PRIORITYSTATE:
-      AUDIT
-      printk("%s: [Major, Minor = %d, %d] Somebody called an ioctl for priority change\n",MODNAME,get_major(filp),minor);
+      audit("%s: [Major, Minor = %d, %d] Somebody called an ioctl for priority change\n",MODNAME,get_major(filp),minor);
       if(value == 0){
-        the_object->priority = false;
+        session->priority = false;
         return 0;
       }
       if(value == 1){
-        the_object->priority = true;
+        session->priority = true;
         return 0;
       }
       break;
 
   // PARAM 0 (not blocking) or 1 (blocking)
     case IOWR_BLOCKINGSTATE:
-      AUDIT
-      printk("%s: [Major, Minor = %d, %d] Somebody called an ioctl for blocking change\n",MODNAME,get_major(filp),minor);
+      audit("%s: [Major, Minor = %d, %d] Somebody called an ioctl for blocking change\n",MODNAME,get_major(filp),minor);
+
+      if(value == 0){
+        session->blocking = false;
+        return 0;
+      }
+      if(value == 1){
+        session->blocking = true;
+        return 0;
+      }
+      break;
+
+  // PARAM 0 (whole write or nothing) or 1 (partial write)
+    case IOWR_PARTIALSTATE:
+      audit("%s: [Major, Minor = %d, %d] Somebody called an ioctl for partial write change\n",MODNAME,get_major(filp),minor);
+
+      if(value == 0){
+        session->partial = false;
+        return 0;
+      }
+      if(value == 1){
+        session->partial = true;
+        return 0;
+      }
+      break;
+
+  // PARAM 0 (low priority) or 1 (high priority): flow whose indices were moved by a user space mapping
+    case IOWR_MMAPNOTIFY:
+      audit("%s: [Major, Minor = %d, %d] Somebody called an ioctl for mmap notify\n",MODNAME,get_major(filp),minor);
+
+      if(value == 0 || value == 1){
+        // New bytes or new free space in the flow: wake up the sleeping readers and writers
+        wake_up_interruptible(&(session->object->read_queue));
+        wake_up_interruptible(&(session->object->write_queue));
+        return 0;
+      }
+      break;
+
+  // PARAM 0 (locked operations) or 1 (lockless high priority operations, single producer/consumer)
+    case IOWR_SPSCSTATE:
+      audit("%s: [Major, Minor = %d, %d] Somebody called an ioctl for spsc change\n",MODNAME,get_major(filp),minor);
 
       if(value == 0){
-        the_object->blocking = false;
+        session->spsc = false;
         return 0;
       }
       if(value == 1){
-        the_object->blocking = true;
+        session->spsc = true;
         return 0;
       }
       break;
 
-    // Change timeout
+  // PARAM 0 (stream mode) or 1 (record mode) for the flow selected by the priority of the session
+    case IOWR_RECORDSTATE:
+      audit("%s: [Major, Minor = %d, %d] Somebody called an ioctl for record mode change\n",MODNAME,get_major(filp),minor);
+
+      if(value == 0 || value == 1){
+        ret = record_flow(session->object, session->priority ? HIGH_PRIORITY : LOW_PRIORITY, value);
+        if(ret != 0){
+          AUDITERROR
+          printk("%s: [Major, Minor = %d, %d] Error in ioctl, record mode %d not applied (%d)\n", MODNAME, get_major(filp), minor, value, ret);
+        }
+        return ret;
+      }
+      break;
+
+  // PARAM size in bytes of the buffer of the flow selected by the priority of the session
+    case IOWR_RINGSIZE:
+      audit("%s: [Major, Minor = %d, %d] Somebody called an ioctl for buffer size change\n",MODNAME,get_major(filp),minor);
+
+      ret = resize_flow(session->object, session->priority ? HIGH_PRIORITY : LOW_PRIORITY, value);
+      if(ret != 0){
+        AUDITERROR
+        printk("%s: [Major, Minor = %d, %d] Error in ioctl, buffer size %d not applied (%d)\n", MODNAME, get_major(filp), minor, value, ret);
+      }
+      return ret;
+
+    // Change timeout (us): sub-millisecond blocking operations
+    case IOWR_TIMEOUT_US:
+      audit("%s: [Major, Minor = %d, %d] Somebody called an ioctl for timeout (us) change\n",MODNAME,get_major(filp),minor);
+      if(value > 0){
+        session->timeout = value;
+        return 0;
+      }
+      AUDITERROR
+      printk("%s: [Major, Minor = %d, %d] Error in ioctl, negative value\n", MODNAME, get_major(filp), minor);
+      return -1;
+
+    // Change timeout (ms), compatibility with IOWR_TIMEOUT_US
     case IOWR_TIMEOUT:  
-      AUDIT
-      printk("%s: [Major, Minor = %d, %d] Somebody called an ioctl for timeout change\n",MODNAME,get_major(filp),minor);
+      audit("%s: [Major, Minor = %d, %d] Somebody called an ioctl for timeout change\n",MODNAME,get_major(filp),minor);
       if(value > 0){
-        the_object->timeout = value;
+        session->timeout = (s64)value * USEC_PER_MSEC;
         return 0;
       }
       else{
@@ -564,65 +1880,242 @@ static long dev_ioctl(struct file *filp, unsigned int command, unsigned long par
       }  
       break;        
     }
-    AUDIT
-    printk("%s: [Major, Minor = %d, %d] Error in input for ioctl operation and command %u \n",MODNAME,get_major(filp),minor,command);
+    audit("%s: [Major, Minor = %d, %d] Error in input for ioctl operation and command %u \n",MODNAME,get_major(filp),minor,command);
     return -1;
 }
 
+/** debugfs multi-flow/stats: one line for each flow of the device files with activity, counters summed on the CPUs,
+ *  pending delayed writes and bytes readable **/
+static int stats_show(struct seq_file *m, void *v){
+  u64 counters[NUM_STATS];
+  object_state *the_object;
+  unsigned long i;
+  int bytes;
+  int j;
+  int k;
+  int cpu;
+
+  seq_printf(m, "minor flow");
+  for(k=0;k<NUM_STATS;k++) seq_printf(m, " %s", stat_name[k]);
+  seq_printf(m, " pending bytes\n");
+
+  xa_for_each(&objects, i, the_object){
+    for(j=NUM_FLOWS-1;j>=0;j--){
+      memset(counters, 0, sizeof(counters));
+      for_each_possible_cpu(cpu){
+        object_stats *stats = per_cpu_ptr(the_object->stats, cpu);
+        for(k=0;k<NUM_STATS;k++) counters[k] += stats->counters[j][k];
+      }
+      if(counters[STAT_WRITES] == 0 && counters[STAT_READS] == 0 && counters[STAT_FULL] == 0 && counters[STAT_TIMEOUTS] == 0) continue;
+
+      mutex_lock(&(the_object->operation_synchronizer));
+      bytes = the_object->controls != NULL ? flow_readable(&(the_object->flows[j])) : 0;
+      unlock_object(the_object);            // Wake up the waiters whose trylock failed during the scrape
+
+      seq_printf(m, "%lu %s", i, j == HIGH_PRIORITY ? "high" : "low");
+      for(k=0;k<NUM_STATS;k++) seq_printf(m, " %llu", (unsigned long long)counters[k]);
+      seq_printf(m, " %d %d\n", j == LOW_PRIORITY ? READ_ONCE(the_object->num_pending) : 0, bytes);
+    }
+  }
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/** debugfs multi-flow/histograms: one line for each histogram of the flows with samples, the counts of the
+ *  log2 buckets (bucket b: latencies < 2^b ns). Any write resets all the histograms **/
+static int histograms_show(struct seq_file *m, void *v){
+  object_state *the_object;
+  flow_hist *hist;
+  u64 total;
+  unsigned long i;
+  int j;
+  int k;
+  int b;
+
+  seq_printf(m, "minor flow histogram samples, then the bucket counts: latency < 1, 2, 4, ... 2^%d ns, above\n", HIST_BUCKETS - 2);
+  xa_for_each(&objects, i, the_object){
+    for(j=NUM_FLOWS-1;j>=0;j--){
+      hist = the_object->flows[j].hist;
+      if(hist == NULL) continue;
+      for(k=0;k<NUM_HISTS;k++){
+        total = 0;
+        for(b=0;b<HIST_BUCKETS;b++) total += atomic64_read(&(hist->counters[k][b]));
+        if(total == 0) continue;
+
+        seq_printf(m, "%lu %s %s %llu", i, j == HIGH_PRIORITY ? "high" : "low", hist_name[k], (unsigned long long)total);
+        for(b=0;b<HIST_BUCKETS;b++) seq_printf(m, " %lld", (long long)atomic64_read(&(hist->counters[k][b])));
+        seq_printf(m, "\n");
+      }
+    }
+  }
+  return 0;
+}
+
+static int histograms_open(struct inode *inode, struct file *file){
+  return single_open(file, histograms_show, inode->i_private);
+}
+
+static ssize_t histograms_write(struct file *file, const char __user *buffer, size_t len, loff_t *off){
+  object_state *the_object;
+  flow_hist *hist;
+  unsigned long i;
+  int j;
+  int k;
+  int b;
+
+  xa_for_each(&objects, i, the_object){
+    for(j=0;j<NUM_FLOWS;j++){
+      hist = the_object->flows[j].hist;
+      if(hist == NULL) continue;
+      for(k=0;k<NUM_HISTS;k++){
+        for(b=0;b<HIST_BUCKETS;b++) atomic64_set(&(hist->counters[k][b]), 0);
+      }
+    }
+  }
+  return len;
+}
+
+static const struct file_operations histograms_fops = {
+  .owner = THIS_MODULE,
+  .open = histograms_open,
+  .read = seq_read,
+  .write = histograms_write,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
 static struct file_operations fops = {
   .owner = THIS_MODULE,
-  .write = dev_write,
-  .read = dev_read,
+  .write_iter = dev_write_iter,
+  .read_iter = dev_read_iter,
+  // splice/sendfile: pipe pages are copied once, straight between the pipe and the flow, by the iter operations
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+  .splice_read = copy_splice_read,
+#else
+  .splice_read = generic_file_splice_read,
+#endif
+  .splice_write = iter_file_splice_write,
   .open =  dev_open,
   .release = dev_release,
+  .fsync = dev_fsync,
+  .poll = dev_poll,
+  .mmap = dev_mmap,
   .unlocked_ioctl = dev_ioctl
 };
 
 int init_module(void) {
   int i;
 
-  // Initialize the drive internal state: Default prior. true, block. true, timeout 200ms
-  for(i=0;i<MINORS;i++){
-    spin_lock_init(&(objects[i].operation_synchronizer));
-    objects[i].stream_content = NULL;
-    objects[i].stream_content = (char*)__get_free_page(GFP_KERNEL);
-    if(objects[i].stream_content == NULL) goto revert_allocationPage;
-    objects[i].off_read = 0;
-    objects[i].off_write = 0;
-    objects[i].priority = true;           
-    objects[i].blocking = true;           
-    objects[i].timeout = 200;             // Default 200 ms
+  // Size of the buffers of the flows
+  if(ring_size < RING_MIN_SIZE || ring_size > RING_MAX_SIZE){
+    printk("%s: Buffer size %d out of range, using %d\n",MODNAME, ring_size, max_t(int, OBJECT_MAX_SIZE, RING_MIN_SIZE));
+    ring_size = max_t(int, OBJECT_MAX_SIZE, RING_MIN_SIZE);      // At least one page, also with PAGE_SIZE > 4K
+  }
+  ring_size = roundup_pow_of_two(ring_size);
+
+  // Minors of the device file
+  if(num_minors < 1 || num_minors > MAX_MINORS){
+    printk("%s: Number of minors %d out of range, using %d\n",MODNAME, num_minors, MINORS);
+    num_minors = MINORS;
+  }
+
+  // Enable state of the minors: all enabled, then the values given at load time
+  enabled_minors = bitmap_zalloc(num_minors, GFP_KERNEL);
+  if(enabled_minors == NULL) return -ENOMEM;
+  bitmap_fill(enabled_minors, num_minors);
+  if(enable_driver_arg != NULL && apply_enable_driver(enable_driver_arg) != 0){
+    printk("%s: Invalid enableDriver %s, ignored\n",MODNAME, enable_driver_arg);
+  }
+  if(disabled_minors_arg != NULL && apply_disabled_minors(disabled_minors_arg) != 0){
+    printk("%s: Invalid disabledMinors %s, ignored\n",MODNAME, disabled_minors_arg);
+  }
+  kfree(enable_driver_arg);
+  kfree(disabled_minors_arg);
+  enable_driver_arg = NULL;
+  disabled_minors_arg = NULL;
+
+  // Slab caches of the low priority writes
+  for(i=0;i<WORK_CLASSES;i++){
+    work_caches[i] = kmem_cache_create(work_class_name[i], sizeof(packed_work) + work_class_size[i], 0, SLAB_HWCACHE_ALIGN, NULL);
+    if(work_caches[i] == NULL) goto revert_allocationCache;
+  }
 
-    enableDriver[i] = true;                     // Enable all files;
-    init_waitqueue_head(&read_queues[i]);       // Initialize the wait_queues
+  // State of the device files, allocated on the first open of each minor
+  object_cache = kmem_cache_create("multi-flow-object", sizeof(object_state), 0, SLAB_HWCACHE_ALIGN, NULL);
+  if(object_cache == NULL) goto revert_allocation;
 
+  // Workqueue of the low priority flow: per-CPU if the delayed works are bound to a CPU, unbound otherwise
+  if(wq_cpu >= 0 && (wq_cpu >= nr_cpu_ids || !cpu_online(wq_cpu))){
+    printk("%s: CPU %d is not online, delayed works not bound to a CPU\n",MODNAME, wq_cpu);
+    wq_cpu = -1;
+  }
+  if(wq_node != NUMA_NO_NODE && (wq_node < 0 || wq_node >= nr_node_ids || !node_online(wq_node))){
+    printk("%s: NUMA node %d is not online, delayed works not bound to a NUMA node\n",MODNAME, wq_node);
+    wq_node = NUMA_NO_NODE;
+  }
+  if(wq_max_active < 0 || wq_max_active > WQ_MAX_ACTIVE) wq_max_active = 0;
+  flow_workqueue = alloc_workqueue("multi-flow-wq", wq_cpu >= 0 ? 0 : WQ_UNBOUND, wq_max_active);
+  if(flow_workqueue == NULL){
+    AUDITERROR
+    printk("%s: Workqueue allocation failed\n",MODNAME);
+    goto revert_allocationObject;
   }
 
-  Major = __register_chrdev(0, 0, 128, DEVICE_NAME, &fops);
+  Major = __register_chrdev(0, 0, num_minors, DEVICE_NAME, &fops);
   //actually allowed minors are directly controlled within this driver
 
   if (Major < 0) {
     AUDITERROR
     printk("%s: Registering device failed\n",MODNAME);
-    return Major;
+    destroy_workqueue(flow_workqueue);
+    goto revert_allocationObject;
   }
   printk(KERN_INFO "%s: New device registered, it is assigned major number %d\n",MODNAME, Major);
+
+  // Statistics for the monitoring: debugfs is optional, the errors are not fatal
+  debugfs_dir = debugfs_create_dir("multi-flow", NULL);
+  debugfs_create_file("stats", 0444, debugfs_dir, NULL, &stats_fops);
+  debugfs_create_file("histograms", 0644, debugfs_dir, NULL, &histograms_fops);
   return 0;
 
-revert_allocationPage:
+revert_allocationObject:
+  kmem_cache_destroy(object_cache);
+
+revert_allocation:
+  i = WORK_CLASSES - 1;
+
+revert_allocationCache:
   for(;i>=0;i--){
-    free_page((unsigned long)objects[i].stream_content);
+    kmem_cache_destroy(work_caches[i]);
   }
-  return -ENOMEM;
+  bitmap_free(enabled_minors);
+  enabled_minors = NULL;
+  return Major < 0 ? Major : -ENOMEM;
 }
 
 void cleanup_module(void) {
 
+  object_state *the_object;
+  unsigned long minor;
   int i;
-  for(i=0;i<MINORS;i++){
-    free_page((unsigned long)objects[i].stream_content);
+
+  debugfs_remove_recursive(debugfs_dir);
+  __unregister_chrdev(Major, 0, num_minors, DEVICE_NAME);      // Same range of __register_chrdev
+  xa_for_each(&objects, minor, the_object){
+    flush_delayed_work(&(the_object->the_work));   // Commit the writes still waiting for the batch delay
+    cancel_delayed_work_sync(&(the_object->reclaim_work));
+  }
+  destroy_workqueue(flow_workqueue);        // Drain the pending delayed works before freeing the flows
+  xa_for_each(&objects, minor, the_object){
+    free_object(the_object);
+    destroy_object(the_object);
+  }
+  xa_destroy(&objects);
+  kmem_cache_destroy(object_cache);
+  for(i=0;i<WORK_CLASSES;i++){
+    kmem_cache_destroy(work_caches[i]);
   }
-  unregister_chrdev(Major, DEVICE_NAME);
+  bitmap_free(enabled_minors);
   printk(KERN_INFO "%s: New device unregistered, it was assigned major number %d\n",MODNAME, Major);
 
   return;
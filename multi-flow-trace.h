@@ -0,0 +1,111 @@
+/** Tracepoints of the multi-flow device file (events/multi_flow in tracefs).
+ *  Disabled tracepoints cost a patched out branch: the read/write paths take the timestamps for the latencies
+ *  only when the matching event is enabled
+ **/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM multi_flow
+
+#if !defined(_MULTI_FLOW_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MULTI_FLOW_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Bytes moved in a flow (1 high priority, 0 low priority) and latency (ns) of the operation
+DECLARE_EVENT_CLASS(multi_flow_io,
+
+  TP_PROTO(int minor, int flow, ssize_t bytes, u64 latency),
+
+  TP_ARGS(minor, flow, bytes, latency),
+
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(int, flow)
+    __field(ssize_t, bytes)
+    __field(u64, latency)
+  ),
+
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->flow = flow;
+    __entry->bytes = bytes;
+    __entry->latency = latency;
+  ),
+
+  TP_printk("minor=%d flow=%s bytes=%zd latency=%llu ns", __entry->minor, __entry->flow ? "high" : "low",
+            __entry->bytes, (unsigned long long)__entry->latency)
+);
+
+// write/writev/io_uring on the device file: latency of the call, bytes written (low priority: enqueued) or error
+DEFINE_EVENT(multi_flow_io, multi_flow_write,
+  TP_PROTO(int minor, int flow, ssize_t bytes, u64 latency),
+  TP_ARGS(minor, flow, bytes, latency)
+);
+
+// read/readv/io_uring on the device file (flow: priority of the session): latency of the call, bytes read or error
+DEFINE_EVENT(multi_flow_io, multi_flow_read,
+  TP_PROTO(int minor, int flow, ssize_t bytes, u64 latency),
+  TP_ARGS(minor, flow, bytes, latency)
+);
+
+// Low priority write committed by the delayed work: latency from the enqueue
+DEFINE_EVENT(multi_flow_io, multi_flow_commit,
+  TP_PROTO(int minor, int flow, ssize_t bytes, u64 latency),
+  TP_ARGS(minor, flow, bytes, latency)
+);
+
+// Low priority write queued for the delayed work
+TRACE_EVENT(multi_flow_enqueue,
+
+  TP_PROTO(int minor, int bytes, int pending),
+
+  TP_ARGS(minor, bytes, pending),
+
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(int, bytes)
+    __field(int, pending)
+  ),
+
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->bytes = bytes;
+    __entry->pending = pending;
+  ),
+
+  TP_printk("minor=%d bytes=%d pending=%d", __entry->minor, __entry->bytes, __entry->pending)
+);
+
+// Read or write ended without bytes: timeout elapsed, or flow full/empty for a not blocking operation (timeout 0)
+TRACE_EVENT(multi_flow_timeout,
+
+  TP_PROTO(int minor, int flow, bool write, unsigned int timeout),
+
+  TP_ARGS(minor, flow, write, timeout),
+
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(int, flow)
+    __field(bool, write)
+    __field(unsigned int, timeout)
+  ),
+
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->flow = flow;
+    __entry->write = write;
+    __entry->timeout = timeout;
+  ),
+
+  TP_printk("minor=%d flow=%s op=%s timeout=%u us", __entry->minor, __entry->flow ? "high" : "low",
+            __entry->write ? "write" : "read", __entry->timeout)
+);
+
+#endif /* _MULTI_FLOW_TRACE_H */
+
+// This part must be outside protection
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE multi-flow-trace
+#include <trace/define_trace.h>
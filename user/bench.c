@@ -0,0 +1,495 @@
+/**
+ * Benchmark: throughput and latency of the device driver
+ * Writer and reader threads on the minors of the device file, each one with its own session and pinned
+ * to a CPU (round robin on the CPUs the benchmark can run on, sched_getaffinity). Every thread runs write/read operations of the same size
+ * for the whole duration, taking the latency of each call:
+ * - ops/s, MB/s and latency percentiles of the writes for each flow (high/low priority) and of the reads:
+ *   a read drains the high priority flow first, then the low priority one, so the reads are a single row
+ * - counters of the driver (debugfs multi-flow/stats) before and after the run, as differences
+ * The results are printed in standard output, in CSV or JSON.
+ * The device files must exist (path + minor, as created by user1/user2); debugfs is optional.
+ **/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Input value for ioctl function
+typedef struct _session_config {
+	int priority;
+	int blocking;
+	int partial;
+	int spsc;
+	int timeout;			// us
+} session_config;
+
+#define IOWR_SESSIONCONFIG _IOW('a','j',session_config)
+
+#define STATS_PATH "/sys/kernel/debug/multi-flow/stats"
+#define STATS_VALUES 32
+
+#define HIGH 1
+#define LOW 0
+#define BOTH 2
+
+#define WRITER 0
+#define READER 1
+
+// Latency histogram: log-linear buckets, 16 sub-buckets for each power of two of the ns (error < 6.25%)
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define HIST_SIZE (64 * SUB_BUCKETS)
+
+typedef struct _histogram {
+	unsigned long long counts[HIST_SIZE];
+	unsigned long long max;
+} histogram;
+
+typedef struct _input_thread {
+	int id;
+	int role;			// WRITER or READER
+	int flow;			// HIGH or LOW: priority of the session (writers), BOTH for the readers
+	int minor;
+	int cpu;			// -1 not pinned (or pinning failed)
+	unsigned long long ops;
+	unsigned long long bytes;
+	unsigned long long misses;	// Write on a full flow / read on an empty one (0 bytes or EAGAIN)
+	unsigned long long errors;
+	histogram hist;
+} input_thread;
+
+// Configuration, from the command line
+static char *path = "/dev/flow";
+static int msg_size = 64;
+static int num_writers = 1;
+static int num_readers = 1;
+static int flow = HIGH;
+static int blocking = 1;
+static int num_minors = 1;
+static int duration = 5;
+static int timeout = 200000;
+static int pin = 1;
+static int json = 0;
+
+static atomic_int stop;
+static atomic_int pin_failures;
+
+static unsigned long long now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_index(unsigned long long ns){
+	int msb;
+
+	if(ns < SUB_BUCKETS) return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - SUB_BITS + 1) * SUB_BUCKETS + ((ns >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// Lowest latency of the bucket
+static unsigned long long hist_value(int index){
+	int shift;
+
+	if(index < SUB_BUCKETS) return index;
+	shift = index / SUB_BUCKETS - 1;
+	return (unsigned long long)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+}
+
+static void hist_add(histogram *h, unsigned long long ns){
+	h->counts[hist_index(ns)]++;
+	if(ns > h->max) h->max = ns;
+}
+
+static void hist_merge(histogram *to, histogram *from){
+	int i;
+
+	for(i=0;i<HIST_SIZE;i++) to->counts[i] += from->counts[i];
+	if(from->max > to->max) to->max = from->max;
+}
+
+static unsigned long long hist_percentile(histogram *h, unsigned long long total, double p){
+	unsigned long long rank = (unsigned long long)(p * total / 100.0);
+	unsigned long long seen = 0;
+	int i;
+
+	if(total == 0) return 0;
+	for(i=0;i<HIST_SIZE;i++){
+		seen += h->counts[i];
+		if(seen > rank) return hist_value(i);
+	}
+	return h->max;
+}
+
+void * the_thread(void* val){
+
+	input_thread* s = (input_thread*)val;
+	char device[256];
+	session_config config;
+	cpu_set_t cpus;
+	unsigned long long start;
+	char *buff;
+	int fd;
+	int ret;
+
+	if(s->cpu >= 0){
+		CPU_ZERO(&cpus);
+		CPU_SET(s->cpu, &cpus);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if(ret != 0){
+			fprintf(stderr, "[threadID, CPU] = [%d, %d]: Error in pinning, the thread is not pinned: %s\n", s->id, s->cpu, strerror(ret));
+			s->cpu = -1;
+			atomic_fetch_add(&pin_failures, 1);
+		}
+	}
+
+	snprintf(device, sizeof(device), "%s%d", path, s->minor);
+	fd = open(device, s->role == WRITER ? O_WRONLY : O_RDONLY);
+	if(fd == -1) {
+		fprintf(stderr, "[threadID, Device] = [%d, %s]: Error to open the device: %s\n", s->id, device, strerror(errno));
+		s->errors++;
+		return NULL;
+	}
+
+	// Whole session configured with one call
+	config.priority = s->flow == LOW ? LOW : HIGH;	// Readers: the priority only tags the session
+	config.blocking = blocking;
+	config.partial = 0;
+	config.spsc = 0;
+	config.timeout = timeout;
+	if(ioctl(fd, IOWR_SESSIONCONFIG, &config) == -1){
+		fprintf(stderr, "[threadID, Device] = [%d, %s]: Error in ioctl: %s\n", s->id, device, strerror(errno));
+	}
+
+	buff = malloc(msg_size);
+	memset(buff, 'a' + s->id % 26, msg_size);
+
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)){
+		start = now_ns();
+		if(s->role == WRITER) ret = write(fd, buff, msg_size);
+		else ret = read(fd, buff, msg_size);
+
+		if(ret > 0){
+			hist_add(&s->hist, now_ns() - start);
+			s->ops++;
+			s->bytes += ret;
+		}
+		else if(ret == 0 || errno == EAGAIN || errno == EINTR) s->misses++;
+		else s->errors++;
+	}
+
+	free(buff);
+	close(fd);
+	return NULL;
+}
+
+// Counters of the driver: the lines of debugfs multi-flow/stats ("minor flow" then the values),
+// up to max_lines: two for each benchmarked minor
+typedef struct _driver_stats {
+	char header[1024];
+	int num_values;
+	int num_lines;
+	int max_lines;
+	int *minor;
+	char (*flow)[8];
+	unsigned long long (*values)[STATS_VALUES];
+} driver_stats;
+
+static driver_stats *alloc_stats(int max_lines){
+	driver_stats *st = calloc(1, sizeof(driver_stats));
+
+	if(st == NULL) return NULL;
+	st->max_lines = max_lines;
+	st->minor = calloc(max_lines, sizeof(*st->minor));
+	st->flow = calloc(max_lines, sizeof(*st->flow));
+	st->values = calloc(max_lines, sizeof(*st->values));
+	if(st->minor == NULL || st->flow == NULL || st->values == NULL){
+		free(st->minor);
+		free(st->flow);
+		free(st->values);
+		free(st);
+		return NULL;
+	}
+	return st;
+}
+
+static void free_stats(driver_stats *st){
+	if(st == NULL) return;
+	free(st->minor);
+	free(st->flow);
+	free(st->values);
+	free(st);
+}
+
+static int read_stats(driver_stats *st){
+	char line[1024];
+	char *token;
+	char *save;
+	FILE *f;
+	int n;
+
+	st->num_values = 0;
+	st->num_lines = 0;
+	f = fopen(STATS_PATH, "r");
+	if(f == NULL) return -1;
+	if(fgets(st->header, sizeof(st->header), f) == NULL){
+		fclose(f);
+		return -1;
+	}
+	st->header[strcspn(st->header, "\n")] = 0;
+	while(st->num_lines < st->max_lines && fgets(line, sizeof(line), f) != NULL){
+		token = strtok_r(line, " \n", &save);
+		if(token == NULL) continue;
+		st->minor[st->num_lines] = atoi(token);
+		if(st->minor[st->num_lines] >= num_minors) continue;
+		token = strtok_r(NULL, " \n", &save);
+		if(token == NULL) continue;
+		snprintf(st->flow[st->num_lines], 8, "%s", token);
+		for(n=0;n<STATS_VALUES && (token = strtok_r(NULL, " \n", &save)) != NULL;n++){
+			st->values[st->num_lines][n] = strtoull(token, NULL, 10);
+		}
+		st->num_values = n;
+		st->num_lines++;
+	}
+	fclose(f);
+	return 0;
+}
+
+// Value of the same minor and flow before the run (0 if the line was not there)
+static unsigned long long stats_before(driver_stats *before, int minor, char *flow_name, int k){
+	int i;
+
+	for(i=0;i<before->num_lines;i++){
+		if(before->minor[i] == minor && strcmp(before->flow[i], flow_name) == 0) return before->values[i][k];
+	}
+	return 0;
+}
+
+// Name of the k-th counter in the header (after "minor flow")
+static void stats_name(driver_stats *st, int k, char *name, int len){
+	char header[1024];
+	char *token;
+	char *save;
+	int i;
+
+	snprintf(name, len, "counter%d", k);
+	strcpy(header, st->header);
+	token = strtok_r(header, " ", &save);
+	for(i=-2;token != NULL;i++){
+		if(i == k){
+			snprintf(name, len, "%s", token);
+			return;
+		}
+		token = strtok_r(NULL, " ", &save);
+	}
+}
+
+static void print_stats(driver_stats *before, driver_stats *after){
+	char name[64];
+	int first = 1;
+	int i;
+	int k;
+
+	if(json) printf("  \"driver\": [");
+	else printf("\nminor,flow,counter,delta\n");
+	for(i=0;i<after->num_lines;i++){
+		for(k=0;k<after->num_values;k++){
+			// Counters, not gauges (pending and bytes): the value after the run
+			unsigned long long delta = after->values[i][k];
+
+			stats_name(after, k, name, sizeof(name));
+			if(strcmp(name, "pending") != 0 && strcmp(name, "bytes") != 0) delta -= stats_before(before, after->minor[i], after->flow[i], k);
+			if(json){
+				printf("%s\n    {\"minor\": %d, \"flow\": \"%s\", \"counter\": \"%s\", \"delta\": %llu}", first ? "" : ",",
+				       after->minor[i], after->flow[i], name, delta);
+				first = 0;
+			}
+			else printf("%d,%s,%s,%llu\n", after->minor[i], after->flow[i], name, delta);
+		}
+	}
+	if(json) printf("\n  ]\n");
+}
+
+static void print_results(input_thread *threads, int num_threads, double seconds, int role, int flow_id, int *first){
+	static const double percentiles[] = {50, 90, 99, 99.9};
+	histogram hist;
+	unsigned long long ops = 0;
+	unsigned long long bytes = 0;
+	unsigned long long misses = 0;
+	unsigned long long errors = 0;
+	const char *flow_name = role == READER ? "both" : (flow_id == HIGH ? "high" : "low");
+	int i;
+
+	memset(&hist, 0, sizeof(hist));
+	for(i=0;i<num_threads;i++){
+		if(threads[i].role != role || (role == WRITER && threads[i].flow != flow_id)) continue;
+		hist_merge(&hist, &threads[i].hist);
+		ops += threads[i].ops;
+		bytes += threads[i].bytes;
+		misses += threads[i].misses;
+		errors += threads[i].errors;
+	}
+	if(ops == 0 && misses == 0 && errors == 0) return;
+
+	if(json){
+		printf("%s\n    {\"role\": \"%s\", \"flow\": \"%s\", \"ops\": %llu, \"ops_s\": %.1f, \"mb_s\": %.3f, \"misses\": %llu, \"errors\": %llu",
+		       *first ? "" : ",", role == WRITER ? "write" : "read", flow_name, ops, ops / seconds,
+		       bytes / seconds / 1e6, misses, errors);
+		for(i=0;i<4;i++) printf(", \"p%g_ns\": %llu", percentiles[i], hist_percentile(&hist, ops, percentiles[i]));
+		printf(", \"max_ns\": %llu}", hist.max);
+	}
+	else{
+		printf("%s,%s,%llu,%.1f,%.3f,%llu,%llu", role == WRITER ? "write" : "read", flow_name, ops,
+		       ops / seconds, bytes / seconds / 1e6, misses, errors);
+		for(i=0;i<4;i++) printf(",%llu", hist_percentile(&hist, ops, percentiles[i]));
+		printf(",%llu\n", hist.max);
+	}
+	*first = 0;
+}
+
+static void usage(char *prog){
+	printf("usage: %s [-d pathname] [-s msg_size] [-w writers] [-r readers] [-p high|low|both] [-b 0|1]\n"
+	       "          [-m minors] [-t seconds] [-T timeout_us] [-n (no pinning)] [-j (JSON, default CSV)]\n"
+	       "  writers and readers are threads on each minor, the device files are pathname + minor\n", prog);
+}
+
+int main(int argc, char** argv){
+	input_thread *threads;
+	pthread_t *tids;
+	driver_stats *before;
+	driver_stats *after;
+	int num_threads;
+	cpu_set_t allowed;
+	int *cpu_list;
+	int num_cpus = 0;
+	int have_stats;
+	int first = 1;
+	int opt;
+	int i;
+	int j;
+	int k;
+	unsigned long long start;
+	double seconds;
+
+	while((opt = getopt(argc, argv, "d:s:w:r:p:b:m:t:T:njh")) != -1){
+		switch(opt){
+			case 'd': path = optarg; break;
+			case 's': msg_size = atoi(optarg); break;
+			case 'w': num_writers = atoi(optarg); break;
+			case 'r': num_readers = atoi(optarg); break;
+			case 'p':
+				if(strcmp(optarg, "low") == 0) flow = LOW;
+				else if(strcmp(optarg, "both") == 0) flow = BOTH;
+				else flow = HIGH;
+				break;
+			case 'b': blocking = atoi(optarg) != 0; break;
+			case 'm': num_minors = atoi(optarg); break;
+			case 't': duration = atoi(optarg); break;
+			case 'T': timeout = atoi(optarg); break;
+			case 'n': pin = 0; break;
+			case 'j': json = 1; break;
+			default:
+				usage(argv[0]);
+				return -1;
+		}
+	}
+	if(msg_size <= 0 || num_writers < 0 || num_readers < 0 || num_minors <= 0 || duration <= 0 || timeout <= 0){
+		usage(argv[0]);
+		return -1;
+	}
+
+	num_threads = num_minors * (num_writers + num_readers);
+	threads = calloc(num_threads, sizeof(input_thread));
+	tids = calloc(num_threads, sizeof(pthread_t));
+	before = alloc_stats(2 * num_minors);
+	after = alloc_stats(2 * num_minors);
+	cpu_list = calloc(CPU_SETSIZE, sizeof(int));
+	if(threads == NULL || tids == NULL || before == NULL || after == NULL || cpu_list == NULL){
+		fprintf(stderr, "allocation failure\n");
+		return -1;
+	}
+
+	// CPUs the benchmark can run on (online, allowed by the cpuset): not always numbered 0..n-1
+	if(pin){
+		if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0){
+			fprintf(stderr, "Error in sched_getaffinity, threads not pinned: %s\n", strerror(errno));
+			pin = 0;
+		}
+		else{
+			for(i=0;i<CPU_SETSIZE;i++){
+				if(CPU_ISSET(i, &allowed)) cpu_list[num_cpus++] = i;
+			}
+			if(num_cpus == 0) pin = 0;
+		}
+	}
+
+	// Threads of each minor: with both flows, the writers alternate high and low priority. The readers drain both flows
+	k = 0;
+	for(i=0;i<num_minors;i++){
+		for(j=0;j<num_writers + num_readers;j++){
+			threads[k].id = k;
+			threads[k].role = j < num_writers ? WRITER : READER;
+			threads[k].minor = i;
+			threads[k].flow = flow == BOTH ? (j % 2 ? LOW : HIGH) : flow;
+			if(threads[k].role == READER) threads[k].flow = BOTH;
+			threads[k].cpu = pin ? cpu_list[k % num_cpus] : -1;
+			k++;
+		}
+	}
+
+	have_stats = read_stats(before) == 0;
+	start = now_ns();
+	for(i=0;i<num_threads;i++){
+		if(pthread_create(&tids[i], NULL, the_thread, &threads[i]) != 0){
+			fprintf(stderr, "thread creation failure\n");
+			return -1;
+		}
+	}
+	sleep(duration);
+	atomic_store(&stop, 1);
+	for(i=0;i<num_threads;i++) pthread_join(tids[i], NULL);
+	seconds = (now_ns() - start) / 1e9;
+	if(have_stats) have_stats = read_stats(after) == 0;
+
+	// Threads really pinned: the failures are reported by each thread
+	k = 0;
+	for(i=0;i<num_threads;i++) k += threads[i].cpu >= 0;
+	if(atomic_load(&pin_failures) > 0) fprintf(stderr, "%d threads of %d not pinned\n", atomic_load(&pin_failures), num_threads);
+
+	if(json){
+		printf("{\n  \"msg_size\": %d, \"writers\": %d, \"readers\": %d, \"minors\": %d, \"blocking\": %d, \"pinned\": %d, \"seconds\": %.3f,\n",
+		       msg_size, num_writers, num_readers, num_minors, blocking, k, seconds);
+		printf("  \"results\": [");
+	}
+	else printf("role,flow,ops,ops_s,mb_s,misses,errors,p50_ns,p90_ns,p99_ns,p99.9_ns,max_ns\n");
+	for(i=WRITER;i<=READER;i++){
+		for(j=HIGH;j>=LOW;j--){
+			print_results(threads, num_threads, seconds, i, j, &first);
+			if(i == READER) break;
+		}
+	}
+	if(json) printf("\n  ]%s\n", have_stats ? "," : "");
+	if(have_stats) print_stats(before, after);
+	else fprintf(stderr, "%s not readable: no driver counters\n", STATS_PATH);
+	if(json) printf("}\n");
+
+	free(threads);
+	free(tids);
+	free(cpu_list);
+	free_stats(before);
+	free_stats(after);
+	return 0;
+}